@@ -0,0 +1,255 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <stdlib.h>
+#include "terrainDistance.h"
+
+using namespace std;
+
+//What the speed settings cost in accuracy: a fixed corpus of queries on the pre and post maps, run through every engine mode
+//and through a grid of kernel radii x sample spacings, each compared against a densely sampled reference
+//
+//  ./accuracy.exe [--quick] [--queries file] [--reference-step meters]
+//
+//The reference is the default radius (30 root 2) with samples every cellSize/32 m, i.e. the kernel surface the project
+//defines, measured as finely as it's worth. Spacing error and radius error (a bigger kernel smooths the surface, so paths come
+//out shorter) are both measured against it. For each configuration it prints queries per second (pre and post of one query
+//count as one) next to percentiles of the relative distance error and of the absolute error of post - pre in meters.
+//Last it checks the slopes computeHeightAndGradient gives against central differences of computeHeight
+
+struct Config{
+    string mode;
+    double rp;
+    double step;  //max segment length, 0 for modes that choose their own
+};
+
+struct ConfigResult{
+    double queriesPerSecond;
+    vector<double> relativeErrors; //pre and post of every query
+    vector<double> diffErrors;     //m, one per query
+};
+
+static double percentile(vector<double> values, double fraction){
+    sort(values.begin(), values.end());
+    size_t rank = (size_t)ceil(fraction * (double)values.size());
+    return values[min(values.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+//Fixed seed so every run (and every release) measures the same queries: random endpoints anywhere, short queries (the
+//typical change-detection probe), and rows, columns and diagonals, which the indexed mode answers from its prefix tables
+static vector<SurfaceQuery> makeCorpus(int numQueries){
+    mt19937 random(49);
+    vector<SurfaceQuery> queries;
+    auto add = [&](int x1, int y1, int x2, int y2){
+        x2 = min(DefaultGrid::width - 1, max(0, x2));
+        y2 = min(DefaultGrid::height - 1, max(0, y2));
+        if(x1 != x2 || y1 != y2){
+            queries.push_back(SurfaceQuery{x1, y1, x2, y2});
+        }
+    };
+    while((int)queries.size() < numQueries){
+        int x = (int)(random() % DefaultGrid::width);
+        int y = (int)(random() % DefaultGrid::height);
+        int kind = (int)(queries.size() % 10);
+        int length = 1 + (int)(random() % 200);
+        if(kind < 6){
+            add(x, y, (int)(random() % DefaultGrid::width), (int)(random() % DefaultGrid::height));
+        }
+        else if(kind < 8){
+            add(x, y, x + (int)(random() % 33) - 16, y + (int)(random() % 33) - 16);
+        }
+        else if(kind == 8){
+            (random() & 1) ? add(x, y, x + length, y) : add(x, y, x, y + length);
+        }
+        else{
+            add(x, y, x + length, y + length);
+        }
+    }
+    return queries;
+}
+
+//Same format as --batch, x1 y1 x2 y2 per line
+static bool readCorpus(const string& fileName, vector<SurfaceQuery>& queries){
+    ifstream file(fileName);
+    if(!file.is_open()){
+        return false;
+    }
+    SurfaceQuery q;
+    while(file >> q.x1 >> q.y1 >> q.x2 >> q.y2){
+        if(q.x1 < 0 || q.y1 < 0 || q.x2 < 0 || q.y2 < 0 || q.x1 >= DefaultGrid::width || q.x2 >= DefaultGrid::width || q.y1 >= DefaultGrid::height || q.y2 >= DefaultGrid::height){
+            return false;
+        }
+        queries.push_back(q);
+    }
+    return !queries.empty();
+}
+
+//Distances for every query on both epochs the way config says, timed
+static double runConfig(const Config& config, const TerrainDistanceEngine& engine, const vector<SurfaceQuery>& queries, vector<double>& pre, vector<double>& post){
+    size_t n = queries.size();
+    pre.assign(n, 0.0);
+    post.assign(n, 0.0);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if(config.mode == "walk"){
+        for(size_t k = 0; k < n; k++){
+            pre[k] = engine.surfaceDistance(0, queries[k]);
+            post[k] = engine.surfaceDistance(1, queries[k]);
+        }
+    }
+    else if(config.mode == "pair"){
+        for(size_t k = 0; k < n; k++){
+            engine.surfaceDistancePair(0, 1, queries[k], pre[k], post[k]);
+        }
+    }
+    else if(config.mode == "indexed"){
+        for(size_t k = 0; k < n; k++){
+            pre[k] = engine.surfaceDistanceIndexed(0, queries[k]);
+            post[k] = engine.surfaceDistanceIndexed(1, queries[k]);
+        }
+    }
+    else if(config.mode == "batch"){
+        engine.surfaceDistanceBatch(0, 1, queries, pre, post, (int)max(1u, thread::hardware_concurrency()));
+    }
+    else{ //sampled
+        for(size_t k = 0; k < n; k++){
+            const SurfaceQuery& q = queries[k];
+            pre[k] = computeSurfaceDistanceSampled(q.x1, q.y1, q.x2, q.y2, config.rp, config.step, engine.epochData(0));
+            post[k] = computeSurfaceDistanceSampled(q.x1, q.y1, q.x2, q.y2, config.rp, config.step, engine.epochData(1));
+        }
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+//computeHeightAndGradient's slope against central differences of computeHeight at random points, worst absolute error in
+//m/m. The field is C1 (the kernel's slope goes to zero at rp) but its curvature jumps where a pixel's kernel edge is crossed,
+//so a correct gradient shows an error that shrinks with h (about 1e-5 m/m at 1 mm), a wrong one doesn't
+static double checkGradient(MapView data, double rp, int numPoints, double h, double& maxSlope){
+    mt19937 random(26);
+    uniform_real_distribution<double> px(h, DefaultGrid::width * DefaultGrid::cellSize - h);
+    uniform_real_distribution<double> py(h, DefaultGrid::height * DefaultGrid::cellSize - h);
+    double maxError = 0.0;
+    maxSlope = 0.0;
+    for(int k = 0; k < numPoints; k++){
+        Eigen::Vector3d p(px(random), py(random), 0.0);
+        Eigen::Vector2d grad;
+        computeHeightAndGradient(p, grad, rp, data);
+
+        Eigen::Vector2d difference;
+        for(int axis = 0; axis < 2; axis++){
+            Eigen::Vector3d ahead = p;
+            Eigen::Vector3d behind = p;
+            ahead[axis] += h;
+            behind[axis] -= h;
+            computeHeight(ahead, rp, data);
+            computeHeight(behind, rp, data);
+            difference[axis] = (ahead[2] - behind[2]) / (2.0 * h);
+        }
+        maxError = max(maxError, (grad - difference).cwiseAbs().maxCoeff());
+        maxSlope = max(maxSlope, grad.cwiseAbs().maxCoeff());
+    }
+    return maxError;
+}
+
+int main(int argc, char* argv[]){
+    bool quick = false;
+    string corpusFile;
+    double referenceStep = DefaultGrid::cellSize / 32.0;
+    for(int a = 1; a < argc; a++){
+        string arg = argv[a];
+        if(arg == "--quick"){
+            quick = true;
+        }
+        else if(arg == "--queries" && a + 1 < argc){
+            corpusFile = argv[++a];
+        }
+        else if(arg == "--reference-step" && a + 1 < argc){
+            referenceStep = atof(argv[++a]);
+        }
+        else{
+            cerr << "Usage: " << argv[0] << " [--quick] [--queries file] [--reference-step meters]" << endl;
+            return 1;
+        }
+    }
+    if(!(referenceStep > 0.0)){
+        cerr << "The reference step must be positive!" << endl;
+        return 1;
+    }
+
+    TerrainDistanceEngine engine(true); //with the line tables, for the indexed mode
+    if(engine.loadEpoch("data/pre.data") < 0 || engine.loadEpoch("data/post.data") < 0){
+        cerr << "Failed to read data/pre.data and data/post.data!" << endl;
+        return 1;
+    }
+    vector<SurfaceQuery> queries;
+    if(corpusFile.empty()){
+        queries = makeCorpus(quick ? 300 : 2000);
+    }
+    else if(!readCorpus(corpusFile, queries)){
+        cerr << "Failed to read queries from " << corpusFile << "!" << endl;
+        return 1;
+    }
+
+    const double rp = DefaultGrid::cellSize * sqrt(2);
+    vector<double> referencePre, referencePost;
+    double referenceSeconds = runConfig(Config{"sampled", rp, referenceStep}, engine, queries, referencePre, referencePost);
+    cout << queries.size() << " queries, reference rp " << rp << " m sampled every " << referenceStep << " m (" << fixed << setprecision(1) << queries.size() / referenceSeconds << " queries/s)" << endl << endl;
+
+    //The engine's own modes at the default settings, then the sampled grid. "step" is the longest segment allowed
+    vector<Config> configs = {{"walk", rp, 0.0}, {"pair", rp, 0.0}, {"indexed", rp, 0.0}, {"batch", rp, 0.0}};
+    const double radii[4] = {rp, 60.0, 90.0, 120.0};
+    const double stepFactors[5] = {2.0, 1.0, 0.5, 0.25, 0.125}; //1 is the default, segments just under rp
+    for(double radius : radii){
+        for(double factor : stepFactors){
+            configs.push_back(Config{"sampled", radius, radius * factor});
+        }
+    }
+
+    cout << left << setw(9) << "mode" << right << setw(8) << "rp m" << setw(8) << "step m" << setw(12) << "queries/s"
+         << setw(11) << "rel p50" << setw(11) << "rel p90" << setw(11) << "rel p99" << setw(11) << "rel max"
+         << setw(11) << "diff p50" << setw(11) << "diff p99" << setw(11) << "diff max" << endl;
+    for(const Config& config : configs){
+        vector<double> pre, post;
+        double seconds = runConfig(config, engine, queries, pre, post);
+        ConfigResult result;
+        result.queriesPerSecond = queries.size() / seconds;
+        for(size_t k = 0; k < queries.size(); k++){
+            result.relativeErrors.push_back(fabs(pre[k] - referencePre[k]) / referencePre[k]);
+            result.relativeErrors.push_back(fabs(post[k] - referencePost[k]) / referencePost[k]);
+            result.diffErrors.push_back(fabs((post[k] - pre[k]) - (referencePost[k] - referencePre[k])));
+        }
+        cout << left << setw(9) << config.mode << right << setprecision(1) << setw(8) << config.rp;
+        if(config.step > 0.0){
+            cout << setw(8) << config.step;
+        }
+        else{
+            cout << setw(8) << "-";
+        }
+        cout << setprecision(0) << setw(12) << result.queriesPerSecond << setprecision(3) << scientific;
+        for(double fraction : {0.5, 0.9, 0.99, 1.0}){
+            cout << setw(11) << percentile(result.relativeErrors, fraction);
+        }
+        cout << fixed << setprecision(2);
+        for(double fraction : {0.5, 0.99, 1.0}){
+            cout << setw(11) << percentile(result.diffErrors, fraction);
+        }
+        cout << endl;
+    }
+
+    const double h = 1e-3;
+    int numPoints = quick ? 2000 : 20000;
+    for(int epoch = 0; epoch < 2; epoch++){
+        double maxSlope;
+        double maxError = checkGradient(engine.epochData(epoch), rp, numPoints, h, maxSlope);
+        cout << endl << (epoch == 0 ? "Pre" : "Post") << " gradient vs central differences (h " << defaultfloat << h << " m, " << numPoints << " points): max error "
+             << scientific << setprecision(3) << maxError << " m/m, slopes up to " << fixed << setprecision(2) << maxSlope << " m/m";
+    }
+    cout << endl;
+    return 0;
+}
@@ -0,0 +1,331 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <map>
+#include <random>
+#include <thread>
+#include <stdlib.h>
+#include "terrainDistance.h"
+#include "eigen/bench/BenchTimer.h" //needs -Ieigen, it includes <Eigen/Core>
+
+using namespace std;
+using Eigen::BenchTimer;
+using Eigen::REAL_TIMER;
+
+//Benchmarks for the library: kernel, grid lookup, whole queries by path length and orientation, loading, batch throughput
+//
+//  ./bench.exe [--quick] [--filter text] [--compare baseline.jsonl]
+//
+//--filter runs only the benchmarks whose key (see benchmarkKey) contains text
+//One JSON object per line on stdout (JSON Lines), the first line describes the build and machine. Save one run per release
+//and pass it to --compare to get the change of every benchmark against it (timings only mean something on the same machine)
+//Every timing is the best of TRIES runs of REP calls, in wall clock, so threaded benchmarks are timed like single ones
+//Built with -DTERRAIN_STATS every line also gets the hot path counters per op ("stat_samples" etc., see QueryStat)
+
+//name and params together identify a benchmark across runs, e.g. "walk orientation=diagonal length=256"
+static string benchmarkKey(const string& name, const vector<pair<string, string>>& params){
+    string key = name;
+    for(const pair<string, string>& param : params){
+        key += " " + param.first + "=" + param.second;
+    }
+    return key;
+}
+
+struct BenchResult{
+    string name;
+    vector<pair<string, string>> params;
+    double nsPerOp;                      //best try
+    double nsPerOpMean;
+    long ops;                            //per try
+    double statsPerOp[NUM_QUERY_STATS];  //hot path counters over every try, zero without TERRAIN_STATS
+
+    string key() const{
+        return benchmarkKey(name, params);
+    }
+};
+
+static void printResult(const BenchResult& result){
+    cout << "{\"name\":\"" << result.name << "\"";
+    for(const pair<string, string>& param : result.params){
+        bool number = !param.second.empty() && param.second.find_first_not_of("0123456789") == string::npos;
+        cout << ",\"" << param.first << "\":" << (number ? param.second : "\"" + param.second + "\"");
+    }
+    cout << fixed << setprecision(2) << ",\"ns_per_op\":" << result.nsPerOp << ",\"ns_per_op_mean\":" << result.nsPerOpMean << ",\"ops_per_s\":" << setprecision(0) << 1e9 / result.nsPerOp << ",\"ops\":" << result.ops;
+    if(QUERY_STATS_ENABLED){
+        cout << setprecision(2);
+        for(int k = 0; k < NUM_QUERY_STATS; k++){
+            cout << ",\"stat_" << queryStatName((QueryStat)k) << "\":" << result.statsPerOp[k];
+        }
+    }
+    cout << "}" << endl;
+    cout.unsetf(ios::fixed);
+    cout << setprecision(6);
+}
+
+//Runs one benchmark: tries runs of reps calls to op, op returns something so the work can't be optimized away
+template<class Op> BenchResult runBenchmark(const string& name, const vector<pair<string, string>>& params, int tries, int reps, long opsPerRep, Op op){
+    BenchTimer timer;
+    double sink = 0.0;
+    QueryStats before = threadQueryStats();
+    BENCH(timer, tries, reps, sink += op());
+    QueryStats spent = subtractQueryStats(threadQueryStats(), before);
+    escape(&sink);
+    BenchResult result;
+    result.name = name;
+    result.params = params;
+    result.ops = (long)reps * opsPerRep;
+    result.nsPerOp = timer.best(REAL_TIMER) * 1e9 / (double)result.ops;
+    result.nsPerOpMean = timer.total(REAL_TIMER) * 1e9 / (double)(result.ops * tries);
+    for(int k = 0; k < NUM_QUERY_STATS; k++){
+        result.statsPerOp[k] = (double)spent.counts[k] / (double)(result.ops * tries);
+    }
+    return result;
+}
+
+//Paths of length pixels along the major axis, starting at random pixels so the whole path is on the map
+static vector<SurfaceQuery> makePaths(const string& orientation, int length, int count, mt19937& random){
+    int last = DefaultGrid::width - 1;
+    vector<SurfaceQuery> paths;
+    for(int k = 0; k < count; k++){
+        int x = (int)(random() % (last - length + 1));
+        int y = (int)(random() % (last - length + 1));
+        if(orientation == "horizontal"){
+            paths.push_back(SurfaceQuery{x, y, x + length, y});
+        }
+        else if(orientation == "vertical"){
+            paths.push_back(SurfaceQuery{x, y, x, y + length});
+        }
+        else if(orientation == "diagonal"){
+            paths.push_back(SurfaceQuery{x, y, x + length, y + length});
+        }
+        else{ //oblique, about 18 degrees
+            paths.push_back(SurfaceQuery{x, y, x + length, y + length / 3});
+        }
+    }
+    return paths;
+}
+
+//name + params -> ns_per_op from a file this program wrote before
+static map<string, double> readBaseline(const string& fileName){
+    map<string, double> baseline;
+    ifstream file(fileName);
+    string line;
+    while(getline(file, line)){
+        if(line.find("\"ns_per_op\"") == string::npos){
+            continue; //the machine line
+        }
+        //fields are flat "key":"value" or "key":number, pull them apart without a JSON library
+        BenchResult result;
+        double ns = 0.0;
+        size_t at = 1;
+        while(at < line.size()){
+            size_t keyStart = line.find('"', at);
+            if(keyStart == string::npos){
+                break;
+            }
+            size_t keyEnd = line.find('"', keyStart + 1);
+            string fieldName = line.substr(keyStart + 1, keyEnd - keyStart - 1);
+            size_t valueStart = keyEnd + 2;
+            size_t valueEnd;
+            string value;
+            if(line[valueStart] == '"'){
+                valueEnd = line.find('"', valueStart + 1);
+                value = line.substr(valueStart + 1, valueEnd - valueStart - 1);
+                valueEnd++;
+            }
+            else{
+                valueEnd = line.find_first_of(",}", valueStart);
+                value = line.substr(valueStart, valueEnd - valueStart);
+            }
+            if(fieldName == "name"){
+                result.name = value;
+            }
+            else if(fieldName == "ns_per_op"){
+                ns = atof(value.c_str());
+            }
+            else if(fieldName != "ns_per_op_mean" && fieldName != "ops_per_s" && fieldName != "ops" && fieldName.compare(0, 5, "stat_") != 0){
+                result.params.push_back(make_pair(fieldName, value));
+            }
+            at = valueEnd + 1;
+        }
+        baseline[result.key()] = ns;
+    }
+    return baseline;
+}
+
+int main(int argc, char* argv[]){
+    bool quick = false;
+    string filter, compareFile;
+    for(int a = 1; a < argc; a++){
+        string arg = argv[a];
+        if(arg == "--quick"){
+            quick = true;
+        }
+        else if(arg == "--filter" && a + 1 < argc){
+            filter = argv[++a];
+        }
+        else if(arg == "--compare" && a + 1 < argc){
+            compareFile = argv[++a];
+        }
+        else{
+            cerr << "Usage: " << argv[0] << " [--quick] [--filter text] [--compare baseline.jsonl]" << endl;
+            return 1;
+        }
+    }
+
+    vector<unsigned char> dataPre, dataPost;
+    if(!readRaster("data/pre.data", dataPre) || !readRaster("data/post.data", dataPost)){
+        cerr << "Failed to read data/pre.data and data/post.data!" << endl;
+        return 1;
+    }
+
+    int hardwareThreads = (int)thread::hardware_concurrency();
+#ifdef __AVX__
+    bool avx = true;
+#else
+    bool avx = false;
+#endif
+#ifdef __OPTIMIZE__
+    bool optimized = true;
+#else
+    bool optimized = false;
+#endif
+    cout << "{\"machine\":{\"compiler\":\"" << __VERSION__ << "\",\"optimized\":" << (optimized ? "true" : "false") << ",\"avx\":" << (avx ? "true" : "false") << ",\"hardware_threads\":" << hardwareThreads << "}}" << endl;
+
+    const int tries = quick ? 3 : 7;
+    const int scale = quick ? 1 : 4; //more reps per try for steadier numbers
+    const double rp = DefaultGrid::cellSize * sqrt(2);
+    mt19937 random(2024);
+    vector<BenchResult> results;
+    auto wanted = [&](const string& name, const vector<pair<string, string>>& params){ return filter.empty() || benchmarkKey(name, params).find(filter) != string::npos; };
+    auto record = [&](const BenchResult& result){ printResult(result); results.push_back(result); };
+
+    //Kernel at random points, the bottom of every query
+    vector<Eigen::Vector3d> points(4096);
+    for(Eigen::Vector3d& p : points){
+        p = Eigen::Vector3d((random() % 1000000) / 1000000.0 * DefaultGrid::width * DefaultGrid::cellSize, (random() % 1000000) / 1000000.0 * DefaultGrid::height * DefaultGrid::cellSize, 0.0);
+    }
+    if(wanted("computeHeight", {})){
+        record(runBenchmark("computeHeight", {}, tries, 25 * scale, (long)points.size(), [&](){
+            double sum = 0.0;
+            for(Eigen::Vector3d p : points){
+                computeHeight(p, rp, MapView(dataPre));
+                sum += p[2];
+            }
+            return sum;
+        }));
+    }
+    if(wanted("PointToGridIndeces", {})){
+        record(runBenchmark("PointToGridIndeces", {}, tries, 100 * scale, (long)points.size(), [&](){
+            double sum = 0.0;
+            for(const Eigen::Vector3d& p : points){
+                sum += PointToGridIndeces(p)[0];
+            }
+            return sum;
+        }));
+    }
+
+    //Whole queries: the scalar reference (computeSurfaceDistance), the walker the engine uses, and the pre+post pair that
+    //computeSurfaceDistances in the command line tool prints
+    const char* orientations[4] = {"horizontal", "vertical", "diagonal", "oblique"};
+    const int lengths[4] = {16, 64, 256, 511};
+    for(const char* orientation : orientations){
+        for(int length : lengths){
+            vector<SurfaceQuery> paths = makePaths(orientation, length, 64, random);
+            vector<pair<string, string>> params = {{"orientation", orientation}, {"length", to_string(length)}};
+            int reps = max(1, scale * 2048 / length);
+            if(wanted("reference", params)){
+                record(runBenchmark("reference", params, tries, reps, (long)paths.size(), [&](){
+                    double sum = 0.0;
+                    for(const SurfaceQuery& q : paths){
+                        sum += computeSurfaceDistance(q.x1, q.y1, q.x2, q.y2, rp, MapView(dataPre));
+                    }
+                    return sum;
+                }));
+            }
+            if(wanted("walk", params)){
+                record(runBenchmark("walk", params, tries, reps, (long)paths.size(), [&](){
+                    double sum = 0.0;
+                    for(const SurfaceQuery& q : paths){
+                        sum += walkSurfaceDistance(q.x1, q.y1, q.x2, q.y2, rp, MapView(dataPre));
+                    }
+                    return sum;
+                }));
+            }
+            if(wanted("pair", params)){
+                record(runBenchmark("pair", params, tries, reps, (long)paths.size(), [&](){
+                    double sum = 0.0;
+                    for(const SurfaceQuery& q : paths){
+                        double distancePre, distancePost;
+                        computeSurfaceDistancePair(q.x1, q.y1, q.x2, q.y2, rp, dataPre, dataPost, distancePre, distancePost);
+                        sum += distancePre + distancePost;
+                    }
+                    return sum;
+                }));
+            }
+        }
+    }
+
+    //Loading: the raw read, and everything an engine does before its first query (read plus the indexes)
+    if(wanted("readRaster", {})){
+        record(runBenchmark("readRaster", {}, tries, 2 * scale, 1, [&](){
+            vector<unsigned char> data;
+            readRaster("data/pre.data", data);
+            return (double)data[0];
+        }));
+    }
+    if(wanted("loadEpoch", {})){
+        record(runBenchmark("loadEpoch", {}, tries, scale, 1, [&](){
+            TerrainDistanceEngine engine;
+            return (double)engine.loadEpoch("data/pre.data");
+        }));
+    }
+
+    //Batch throughput over thread counts, random endpoints so path lengths and orientations are mixed
+    vector<SurfaceQuery> batch(quick ? 2000 : 10000);
+    for(SurfaceQuery& q : batch){
+        q = SurfaceQuery{(int)(random() % 512), (int)(random() % 512), (int)(random() % 512), (int)(random() % 512)};
+    }
+    vector<int> threadCounts;
+    for(int threads = 1; threads < hardwareThreads; threads *= 2){
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(max(1, hardwareThreads));
+    for(int threads : threadCounts){
+        vector<pair<string, string>> params = {{"threads", to_string(threads)}};
+        if(wanted("batch", params)){
+            record(runBenchmark("batch", params, tries, 1, (long)batch.size(), [&](){
+                vector<double> distancesPre, distancesPost;
+                computeSurfaceDistanceBatch(batch, dataPre, dataPost, distancesPre, distancesPost, threads);
+                return distancesPre[0] + distancesPost[0];
+            }));
+        }
+    }
+
+    if(!compareFile.empty()){
+        map<string, double> baseline = readBaseline(compareFile);
+        if(baseline.empty()){
+            cerr << "No results in " << compareFile << "!" << endl;
+            return 1;
+        }
+        //to stderr so stdout stays pure JSON Lines and can be saved as the next baseline
+        cerr << endl << left << setw(52) << "benchmark" << setw(14) << "baseline ns" << setw(14) << "now ns" << "change" << endl;
+        for(const BenchResult& result : results){
+            map<string, double>::const_iterator found = baseline.find(result.key());
+            if(found == baseline.end()){
+                continue;
+            }
+            double change = (result.nsPerOp / found->second - 1.0) * 100.0;
+            cerr << setw(52) << result.key() << setw(14) << fixed << setprecision(1) << found->second << setw(14) << result.nsPerOp << showpos << change << "%" << noshowpos;
+            if(change > 10.0){
+                cerr << "  slower";
+            }
+            cerr << endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,309 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <stdexcept>
+#include <cmath>
+#include <stdlib.h>
+#include <unistd.h>
+#include "terrainDistance.h"
+
+using namespace std;
+
+//Stress check for the parts of the library that are shared between threads: LiveEngine, DatasetRegistry and ResultCache,
+//and between processes: republishing attached shared memory segments
+//
+//  ./check.exe [numThreads]
+//
+//Runs on generated maps, so no data files are needed. Prints one line per check and exits non-zero if any failed.
+//Worth building with -fsanitize=address (or thread) too, then a version freed under a reader shows up as a crash report
+//rather than as a wrong distance
+
+static int numFailed = 0;
+
+static void check(bool ok, const string& what){
+    cout << (ok ? "ok      " : "FAILED  ") << what << endl;
+    if(!ok){
+        numFailed++;
+    }
+}
+
+static vector<unsigned char> randomMap(unsigned seed){
+    mt19937 random(seed);
+    vector<unsigned char> data(DefaultGrid::numPixels);
+    for(unsigned char& pixel : data){
+        pixel = (unsigned char)(random() & 255);
+    }
+    return data;
+}
+
+static unique_ptr<TerrainDistanceEngine> randomEngine(unsigned seed){
+    unique_ptr<TerrainDistanceEngine> engine(new TerrainDistanceEngine());
+    engine->addEpoch(randomMap(seed));
+    return engine;
+}
+
+//A few short queries, the answer differs for every map
+static const SurfaceQuery probes[4] = {{10, 10, 30, 17}, {200, 300, 190, 320}, {0, 511, 12, 500}, {400, 100, 415, 100}};
+
+//Readers run queries on whatever version is live and count themselves as holders of it while they do. After publish()
+//returns, no reader may still be holding the version it replaced: that one has been freed
+static void checkLiveEngine(int numThreads){
+    const int numVersions = 200;
+    LiveEngine live;
+    vector<vector<double>> expected(numVersions + 1, vector<double>(4));
+    unique_ptr<atomic<long>[]> holders(new atomic<long>[numVersions + 1]);
+    for(int v = 0; v <= numVersions; v++){
+        holders[v] = 0;
+    }
+    atomic<bool> done(false);
+    atomic<long> reads(0), wrongAnswers(0), wentBack(0);
+
+    vector<thread> readers;
+    for(int t = 0; t < numThreads; t++){
+        readers.emplace_back([&](){
+            uint64_t last = 0;
+            while(!done.load()){
+                LiveEngine::Reader reader(live);
+                uint64_t v = reader.version();
+                if(v == 0){
+                    continue;
+                }
+                if(v < last){
+                    wentBack++;
+                }
+                last = v;
+                holders[v]++;
+                for(int p = 0; p < 4; p++){
+                    if(reader.engine().surfaceDistance(0, probes[p]) != expected[v][p]){
+                        wrongAnswers++;
+                    }
+                }
+                holders[v]--;
+                reads++;
+            }
+        });
+    }
+
+    long heldAfterPublish = 0;
+    for(int v = 1; v <= numVersions; v++){
+        unique_ptr<TerrainDistanceEngine> engine = randomEngine(1000 + v);
+        for(int p = 0; p < 4; p++){
+            expected[v][p] = engine->surfaceDistance(0, probes[p]); //before publish, so readers see it
+        }
+        live.publish(move(engine));
+        if(v > 1){
+            heldAfterPublish += holders[v - 1].load();
+        }
+    }
+    done = true;
+    for(thread& reader : readers){
+        reader.join();
+    }
+
+    cout << "LiveEngine: " << numVersions << " publishes under " << numThreads << " readers, " << reads.load() << " reads" << endl;
+    check(heldAfterPublish == 0, "no reader holds a version once publish() has replaced (and freed) it");
+    check(wrongAnswers == 0, "every read answers for the version it saw");
+    check(wentBack == 0, "a reader never sees an older version after a newer one");
+    check(live.version() == (uint64_t)numVersions, "version counts the publishes");
+}
+
+//Many threads acquire the same datasets while a small budget keeps evicting them
+static void checkRegistry(int numThreads){
+    const int numIds = 8;
+    vector<double> expected(numIds);
+    size_t engineBytes = 0;
+    for(int id = 0; id < numIds; id++){
+        unique_ptr<TerrainDistanceEngine> engine = randomEngine(id);
+        expected[id] = engine->surfaceDistance(0, probes[0]);
+        engineBytes = engine->residentBytes();
+    }
+
+    unique_ptr<atomic<int>[]> calls(new atomic<int>[numIds + 2]);
+    for(int id = 0; id < numIds + 2; id++){
+        calls[id] = 0;
+    }
+    auto load = [&](const string& id, TerrainDistanceEngine& engine){
+        if(id == "bad"){
+            calls[numIds]++;
+            return false;
+        }
+        if(id == "throws"){
+            calls[numIds + 1]++;
+            throw runtime_error("loader failed");
+        }
+        int n = atoi(id.c_str());
+        calls[n]++;
+        this_thread::sleep_for(chrono::milliseconds(5)); //long enough for the other acquires to pile up
+        engine.addEpoch(randomMap(n));
+        return true;
+    };
+    DatasetRegistry registry(load, 3 * engineBytes);
+
+    //Everyone asks for the same dataset at once, it loads once
+    atomic<int> arrived(0);
+    vector<DatasetRegistry::Dataset> got(numThreads);
+    vector<thread> threads;
+    for(int t = 0; t < numThreads; t++){
+        threads.emplace_back([&, t](){
+            arrived++;
+            while(arrived.load() < numThreads){
+                this_thread::yield();
+            }
+            got[t] = registry.acquire("0");
+        });
+    }
+    for(thread& worker : threads){
+        worker.join();
+    }
+    threads.clear();
+    bool sameLoad = true;
+    for(int t = 0; t < numThreads; t++){
+        sameLoad = sameLoad && got[t].engine && got[t].engine == got[0].engine && got[t].generation == got[0].generation;
+    }
+    cout << "DatasetRegistry: " << numThreads << " threads, " << numIds << " datasets, budget of 3" << endl;
+    check(calls[0] == 1, "concurrent acquires of one dataset load it once");
+    check(sameLoad, "and all get the same engine and generation");
+    got.clear();
+
+    //Random datasets from every thread, held a little while they're queried. The budget only fits 3, so most get evicted
+    //while someone still holds them
+    const int acquiresPerThread = 300;
+    atomic<long> missing(0), wrongAnswers(0);
+    for(int t = 0; t < numThreads; t++){
+        threads.emplace_back([&, t](){
+            mt19937 random(t);
+            for(int i = 0; i < acquiresPerThread; i++){
+                int id = (int)(random() % numIds);
+                DatasetRegistry::Dataset dataset = registry.acquire(to_string(id));
+                if(!dataset.engine){
+                    missing++;
+                    continue;
+                }
+                if(dataset.engine->surfaceDistance(0, probes[0]) != expected[id]){
+                    wrongAnswers++;
+                }
+            }
+        });
+    }
+    for(thread& worker : threads){
+        worker.join();
+    }
+    long acquires = numThreads + (long)numThreads * acquiresPerThread;
+    check(missing == 0 && wrongAnswers == 0, "every acquire gets its own dataset's engine, evicted or not");
+    check((long)(registry.hits() + registry.misses()) == acquires, "hits + misses add up to the acquires");
+    check(registry.evictions() > 0 && registry.residentBytes() <= 3 * engineBytes, "evictions keep it under the budget");
+
+    DatasetRegistry::Dataset bad = registry.acquire("bad");
+    DatasetRegistry::Dataset throws = registry.acquire("throws");
+    DatasetRegistry::Dataset throwsAgain = registry.acquire("throws");
+    check(!bad.engine && !throws.engine && !throwsAgain.engine && calls[numIds + 1] == 2, "failed and throwing loads give no engine, and are retried");
+}
+
+//Lookups and inserts from every thread on a cache small enough that sets keep getting replaced. A hit must always be the
+//value that was inserted for exactly that key
+static void checkResultCache(int numThreads){
+    ResultCache cache(1 << 18, 8);
+    auto valueOf = [](uint64_t version, int epoch, const SurfaceQuery& q){
+        return (double)(version * 1000003 + epoch * 7919 + q.x1 * 131 + q.y1 * 17 + q.x2 * 3 + q.y2);
+    };
+    const int operationsPerThread = 200000;
+    atomic<long> wrongHits(0);
+    vector<thread> threads;
+    for(int t = 0; t < numThreads; t++){
+        threads.emplace_back([&, t](){
+            mt19937 random(100 + t);
+            for(int i = 0; i < operationsPerThread; i++){
+                uint64_t version = 1 + random() % 4;
+                int epoch = (int)(random() % 2);
+                SurfaceQuery q = ResultCache::canonical(SurfaceQuery{(int)(random() % 6), (int)(random() % 6), (int)(random() % 6), (int)(random() % 6)});
+                double distance;
+                if(cache.lookup(version, epoch, 42.0, q, distance)){
+                    if(distance != valueOf(version, epoch, q)){
+                        wrongHits++;
+                    }
+                }
+                else{
+                    cache.insert(version, epoch, 42.0, q, valueOf(version, epoch, q));
+                }
+                if(random() % 5000 == 0){
+                    cache.invalidate(1 + random() % 4);
+                }
+            }
+        });
+    }
+    for(thread& worker : threads){
+        worker.join();
+    }
+    cout << "ResultCache: " << numThreads << " threads, " << cache.capacity() << " entries, " << cache.hits() << " hits, " << cache.misses() << " misses" << endl;
+    check(wrongHits == 0, "every hit is the value inserted for that key");
+    check((long)(cache.hits() + cache.misses()) == (long)numThreads * operationsPerThread, "hits + misses add up to the lookups");
+}
+
+//An engine republishing what it attached, whether or not the segment and the engine agree on line tables. Each copy is
+//attached again and queried from every thread, and must answer like the engine the maps came from
+static void checkSharedRepublish(int numThreads){
+    string prefix = "/terrainCheck" + to_string(getpid());
+    vector<double> expected(4), expectedIndexed(4);
+    bool ok = true;
+    for(int tables = 0; tables < 2; tables++){
+        TerrainDistanceEngine source(tables == 1);
+        source.addEpoch(randomMap(7));
+        for(int p = 0; p < 4; p++){
+            expected[p] = source.surfaceDistance(0, probes[p]);
+            expectedIndexed[p] = source.surfaceDistanceIndexed(0, probes[p]);
+        }
+        TerrainDistanceEngine attached(tables == 0); //the other setting
+        TerrainDistanceEngine republished(tables == 1);
+        bool copied = source.publishShared(prefix + "a") && attached.attachShared(prefix + "a")
+                      && attached.publishShared(prefix + "b") && republished.attachShared(prefix + "b");
+        removeShared(prefix + "a");
+        removeShared(prefix + "b");
+        if(!copied || republished.numEpochs() != 1){
+            ok = false;
+            continue;
+        }
+        atomic<long> wrongAnswers(0);
+        vector<thread> threads;
+        for(int t = 0; t < numThreads; t++){
+            threads.emplace_back([&](){
+                for(int p = 0; p < 4; p++){
+                    if(republished.surfaceDistance(0, probes[p]) != expected[p] || fabs(republished.surfaceDistanceIndexed(0, probes[p]) - expectedIndexed[p]) > 1e-6 * expected[p]){
+                        wrongAnswers++;
+                    }
+                }
+            });
+        }
+        for(thread& worker : threads){
+            worker.join();
+        }
+        ok = ok && wrongAnswers == 0;
+    }
+    cout << "Shared memory: republishing attached segments with and without line tables" << endl;
+    check(ok, "an attached segment republishes and answers the same, whichever line table setting either side has");
+}
+
+int main(int argc, char* argv[]){
+    int numThreads = argc >= 2 ? atoi(argv[1]) : max(4, (int)thread::hardware_concurrency());
+    if(numThreads < 2){
+        cerr << "Usage: ./check.exe [numThreads], at least 2" << endl;
+        return 1;
+    }
+
+    checkLiveEngine(numThreads);
+    checkRegistry(numThreads);
+    checkResultCache(numThreads);
+    checkSharedRepublish(numThreads);
+
+    if(numFailed > 0){
+        cout << numFailed << " checks FAILED" << endl;
+        return 1;
+    }
+    cout << "all checks passed" << endl;
+    return 0;
+}
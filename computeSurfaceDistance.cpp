@@ -1,23 +1,183 @@
 #include <iostream>
 #include <fstream>
+#include <iomanip>
 #include <cmath>
 #include <vector>
+#include <string>
+#include <numeric>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <filesystem>
 #include <stdlib.h>
-#include "eigen/Eigen/Dense"
+#include "terrainDistance.h"
+#include "terrainServer.h"
 
 using namespace std;
 
-//ASSUMPTIONS
-//1. we won't try to query two contiguous pixels since that calculation is done more easily by hand
-//2. this kernel method will work :)
-
-vector<int> PointToGridIndeces(Eigen::Vector3d p);
-double computeSurfaceDistances(int x1, int y1, int x2, int y2, vector<unsigned char>& dataPre, vector<unsigned char>& dataPost);
-int getIndex(int x, int y);
-void computeHeight(Eigen::Vector3d& p, double rp, vector<unsigned char>& data);
+double computeSurfaceDistances(int x1, int y1, int x2, int y2, const vector<unsigned char>& dataPre, const vector<unsigned char>& dataPost, const ChangedTileIndex* changedTiles = nullptr);
+vector<double> computeSurfaceDistancesMultiRadius(int x1, int y1, int x2, int y2, const vector<double>& radii, const vector<unsigned char>& dataPre, const vector<unsigned char>& dataPost);
+template<class Grid> vector<unsigned char> toLayout(const vector<unsigned char>& data, const Grid& grid);
+void benchmarkLayouts(const vector<unsigned char>& data);
 
 main(int argc, char* argv[]){
-    
+
+    //Modes that bring their own maps go first, so they work without data/pre.data and data/post.data around
+
+    //Any other map: ./run.exe --raster file.data width height cellSize verticalScale x1 y1 x2 y2
+    //same engine on a runtime grid, so maps that aren't 512x512 / 30 m / 11 m work too
+    if(argc >= 11 && string(argv[1]) == "--raster"){
+        RuntimeGrid grid;
+        if(!makeRuntimeGrid(atoll(argv[3]), atoll(argv[4]), atof(argv[5]), atof(argv[6]), grid)){
+            cerr << "The map must have a positive size of at most 2^31 - 1 pixels, and a positive cell size and vertical scale!" << endl;
+            return 1;
+        }
+        int x1 = atoi(argv[7]);
+        int y1 = atoi(argv[8]);
+        int x2 = atoi(argv[9]);
+        int y2 = atoi(argv[10]);
+        if(min(min(x1, y1), min(x2, y2)) < 0 || max(x1, x2) >= grid.width || max(y1, y2) >= grid.height){
+            cerr << "Query pixels must be inside the " << grid.width << "x" << grid.height << " map!" << endl;
+            return 1;
+        }
+        vector<unsigned char> data;
+        if(!readRaster(argv[2], data, grid.numPixels)){
+            cerr << "Failed to read " << argv[2] << "!" << endl;
+            return 1;
+        }
+        cout << "Surface distance from pixel A = (" << x1 << "," << y1 << ") to pixel B = (" << x2 << ", " << y2 << "): " << walkSurfaceDistance(x1, y1, x2, y2, grid.cellSize * sqrt(2), data, grid) << endl;
+        return 0;
+    }
+
+    //Epoch series mode: ./run.exe --epochs x1 y1 x2 y2 epoch0.data epoch1.data ...
+    //keeps every epoch resident as sparse tile deltas on top of the first one and prints the A -> B distance on each
+    if(argc >= 7 && string(argv[1]) == "--epochs"){
+        int x1 = atoi(argv[2]);
+        int y1 = atoi(argv[3]);
+        int x2 = atoi(argv[4]);
+        int y2 = atoi(argv[5]);
+        if(min(min(x1, y1), min(x2, y2)) < 0 || max(x1, x2) >= DefaultGrid::width || max(y1, y2) >= DefaultGrid::height){
+            cerr << "Query pixels must be inside the 512x512 map!" << endl;
+            return 1;
+        }
+        EpochStore store;
+        vector<unsigned char> epochData;
+        for(int a = 6; a < argc; a++){
+            if(!readRaster(argv[a], epochData)){
+                cerr << "Failed to read " << argv[a] << "!" << endl;
+                return 1;
+            }
+            addEpoch(store, epochData);
+        }
+        int numEpochs = (int)store.tileSlots.size();
+        cout << numEpochs << " epochs resident in " << epochStoreBytes(store) << " bytes (" << numEpochs * DefaultGrid::numPixels << " as full maps)" << endl;
+        for(int e = 0; e < numEpochs; e++){
+            cout << "Epoch " << e << " (" << argv[6 + e] << "): surface distance " << walkSurfaceDistance(x1, y1, x2, y2, DefaultGrid::cellSize * sqrt(2), getEpoch(store, e)) << endl;
+        }
+        return 0;
+    }
+
+    //Shared memory mode: ./run.exe --publish name [epoch0.data epoch1.data ...] or ./run.exe --unpublish name
+    //puts the epochs (pre and post if none are given) and their indexes in shared memory segment name (e.g. /terrain)
+    //for servers started with --shared to attach to. The segment stays until --unpublish or reboot
+    if(argc >= 3 && string(argv[1]) == "--publish"){
+        TerrainDistanceEngine engine;
+        vector<string> epochFiles(argv + 3, argv + argc);
+        if(argc == 3){
+            epochFiles = {"data/pre.data", "data/post.data"};
+        }
+        for(const string& fileName : epochFiles){
+            if(engine.loadEpoch(fileName) < 0){
+                cerr << "Failed to read " << fileName << "!" << endl;
+                return 1;
+            }
+        }
+        if(!engine.publishShared(argv[2])){
+            cerr << "Failed to publish shared memory segment " << argv[2] << "!" << endl;
+            return 1;
+        }
+        cout << "Published " << engine.numEpochs() << " epochs to shared memory segment " << argv[2] << endl;
+        return 0;
+    }
+    if(argc >= 3 && string(argv[1]) == "--unpublish"){
+        if(!removeShared(argv[2])){
+            cerr << "No shared memory segment " << argv[2] << "!" << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    //Multi-dataset server: ./run.exe --serve socketPath --datasets dir budgetMB
+    //dataset N is the .data files in dir/N (epochs in file name order), loaded on first request and dropped least recently
+    //used first once more than budgetMB are resident. kill -HUP drops them all so changed files get picked up
+    if(argc == 6 && string(argv[1]) == "--serve" && string(argv[3]) == "--datasets"){
+        string root = argv[4];
+        auto load = [root](const string& id, TerrainDistanceEngine& engine){
+            vector<string> epochFiles;
+            error_code error;
+            for(const filesystem::directory_entry& file : filesystem::directory_iterator(root + "/" + id, error)){
+                if(file.path().extension() == ".data"){
+                    epochFiles.push_back(file.path().string());
+                }
+            }
+            sort(epochFiles.begin(), epochFiles.end());
+            for(const string& fileName : epochFiles){
+                if(engine.loadEpoch(fileName) < 0){
+                    cerr << "Failed to read " << fileName << " (must be a 512x512 map)!" << endl;
+                    return false;
+                }
+            }
+            return !epochFiles.empty();
+        };
+        DatasetRegistry registry(load, (size_t)atol(argv[5]) << 20);
+        cout << "Serving datasets from " << root << " on " << argv[2] << endl;
+        return runQueryServer(registry, argv[2], (int)thread::hardware_concurrency()) ? 0 : 1;
+    }
+
+    //Server mode: ./run.exe --serve socketPath [epoch0.data epoch1.data ... | --shared name]
+    //keeps the epochs (pre and post if none are given) loaded and answers queries on a Unix socket until killed, see terrainServer.h
+    //With --shared the epochs come from a segment made by --publish, so any number of servers share one copy
+    //kill -HUP reloads the files (or reattaches the segment) without dropping a query
+    if(argc >= 3 && string(argv[1]) == "--serve"){
+        //how to fill an engine, run once now and again on every SIGHUP so replaced files or a republished segment get picked up
+        vector<string> epochFiles;
+        string sharedName;
+        if(argc == 5 && string(argv[3]) == "--shared"){
+            sharedName = argv[4];
+        }
+        else if(argc == 3){
+            epochFiles = {"data/pre.data", "data/post.data"};
+        }
+        else{
+            epochFiles.assign(argv + 3, argv + argc);
+        }
+        auto load = [epochFiles, sharedName](TerrainDistanceEngine& engine){
+            if(!sharedName.empty()){
+                if(!engine.attachShared(sharedName)){
+                    cerr << "Failed to attach shared memory segment " << sharedName << "!" << endl;
+                    return false;
+                }
+                return true;
+            }
+            for(const string& fileName : epochFiles){
+                if(engine.loadEpoch(fileName) < 0){
+                    cerr << "Failed to read " << fileName << "!" << endl;
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        unique_ptr<TerrainDistanceEngine> engine(new TerrainDistanceEngine());
+        if(!load(*engine)){
+            return 1;
+        }
+        cout << "Serving " << engine->numEpochs() << " epochs on " << argv[2] << endl;
+        LiveEngine live;
+        live.publish(move(engine));
+        return runQueryServer(live, argv[2], (int)thread::hardware_concurrency(), load) ? 0 : 1;
+    }
+
     //Step 1: Read in input data
     ifstream filePre("data/pre.data", ios::binary);
     ifstream filePost("data/post.data", ios::binary);
@@ -26,8 +186,8 @@ main(int argc, char* argv[]){
         return 1;
     }
 
-    vector<unsigned char> dataPre(262144);
-    vector<unsigned char> dataPost(262144);
+    vector<unsigned char> dataPre(DefaultGrid::numPixels);
+    vector<unsigned char> dataPost(DefaultGrid::numPixels);
     filePre.read(reinterpret_cast<char*>(dataPre.data()), dataPre.size());      //reinterpret cast required by read function
     filePost.read(reinterpret_cast<char*>(dataPost.data()), dataPost.size());   //thanks to chatG2P for all the binary stream syntax i ever wanted <3
 
@@ -36,10 +196,148 @@ main(int argc, char* argv[]){
         return 1;
     }
 
+    //One-to-all mode: ./run.exe --map x0 y0 outPrefix [numThreads]
+    //writes outPrefix_pre.f32, outPrefix_post.f32 and outPrefix_diff.f32 (512x512 raw floats, same pixel order as the .data files)
+    if(argc >= 5 && string(argv[1]) == "--map"){
+        int x0 = atoi(argv[2]);
+        int y0 = atoi(argv[3]);
+        string prefix = argv[4];
+        int numThreads = (argc >= 6) ? atoi(argv[5]) : (int)thread::hardware_concurrency();
+        if(x0 < 0 || x0 >= DefaultGrid::width || y0 < 0 || y0 >= DefaultGrid::height){
+            cerr << "Origin must be a pixel inside the 512x512 map!" << endl;
+            return 1;
+        }
+
+        vector<float> mapPre, mapPost, mapDiff;
+        computeSurfaceDistanceMap(x0, y0, dataPre, dataPost, mapPre, mapPost, mapDiff, numThreads);
+        if(!writeFloatRaster(prefix + "_pre.f32", mapPre) || !writeFloatRaster(prefix + "_post.f32", mapPost) || !writeFloatRaster(prefix + "_diff.f32", mapDiff)){
+            cerr << "Failed to write distance maps!" << endl;
+            return 1;
+        }
+        cout << "Wrote surface distance maps from pixel (" << x0 << "," << y0 << ") to " << prefix << "_{pre,post,diff}.f32" << endl;
+        return 0;
+    }
+
+    //Pairwise mode: ./run.exe --matrix points.txt outPrefix [--upper] [numThreads]
+    //points.txt holds one "x y" pixel per line, writes outPrefix_pre.f32, outPrefix_post.f32 and outPrefix_diff.f32
+    //as dense NxN row-major floats, or with --upper just the entries above the diagonal (row by row, N(N-1)/2 floats)
+    if(argc >= 4 && string(argv[1]) == "--matrix"){
+        ifstream pointsFile(argv[2]);
+        if(!pointsFile.is_open()){
+            cerr << "Failed to open " << argv[2] << "!" << endl;
+            return 1;
+        }
+        vector<Eigen::Vector2i> points;
+        int x, y;
+        while(pointsFile >> x >> y){
+            if(x < 0 || x >= DefaultGrid::width || y < 0 || y >= DefaultGrid::height){
+                cerr << "Point (" << x << "," << y << ") is outside the 512x512 map!" << endl;
+                return 1;
+            }
+            points.push_back(Eigen::Vector2i(x, y));
+        }
+        string prefix = argv[3];
+        bool upperTriangular = false;
+        int numThreads = (int)thread::hardware_concurrency();
+        for(int a = 4; a < argc; a++){
+            if(string(argv[a]) == "--upper"){
+                upperTriangular = true;
+            }
+            else{
+                numThreads = atoi(argv[a]);
+            }
+        }
+
+        int n = (int)points.size();
+        vector<float> matrixPre, matrixPost;
+        computeSurfaceDistanceMatrix(points, dataPre, dataPost, matrixPre, matrixPost, numThreads);
+        vector<float> matrixDiff(matrixPre.size());
+        for(int k = 0; k < (int)matrixDiff.size(); k++){
+            matrixDiff[k] = matrixPost[k] - matrixPre[k];
+        }
+        if(!writeDistanceMatrix(prefix + "_pre.f32", matrixPre, n, upperTriangular) || !writeDistanceMatrix(prefix + "_post.f32", matrixPost, n, upperTriangular) || !writeDistanceMatrix(prefix + "_diff.f32", matrixDiff, n, upperTriangular)){
+            cerr << "Failed to write distance matrices!" << endl;
+            return 1;
+        }
+        cout << "Wrote " << n << "x" << n << " surface distance matrices to " << prefix << "_{pre,post,diff}.f32" << endl;
+        return 0;
+    }
+
+    //Most of the post map is the same as the pre map, so find the changed tiles once and only redo post samples near them
+    ChangedTileIndex changedTiles = buildChangedTileIndex(dataPre, dataPost, 16);
+
+    //Batch mode: ./run.exe --batch queries.txt results.txt [numThreads]
+    //queries.txt holds one "x1 y1 x2 y2" query per line, results.txt gets "pre post post-pre" on the matching line
+    if(argc >= 4 && string(argv[1]) == "--batch"){
+        ifstream queryFile(argv[2]);
+        if(!queryFile.is_open()){
+            cerr << "Failed to open " << argv[2] << "!" << endl;
+            return 1;
+        }
+        vector<SurfaceQuery> queries;
+        SurfaceQuery q;
+        while(queryFile >> q.x1 >> q.y1 >> q.x2 >> q.y2){
+            if(min(min(q.x1, q.y1), min(q.x2, q.y2)) < 0 || max(q.x1, q.x2) >= DefaultGrid::width || max(q.y1, q.y2) >= DefaultGrid::height){
+                cerr << "Query (" << q.x1 << "," << q.y1 << ") -> (" << q.x2 << "," << q.y2 << ") is outside the 512x512 map!" << endl;
+                return 1;
+            }
+            queries.push_back(q);
+        }
+        int numThreads = (argc >= 5) ? atoi(argv[4]) : (int)thread::hardware_concurrency();
+
+        vector<double> distancesPre, distancesPost;
+        computeSurfaceDistanceBatch(queries, dataPre, dataPost, distancesPre, distancesPost, numThreads);
+
+        ofstream resultFile(argv[3]);
+        if(!resultFile.is_open()){
+            cerr << "Failed to open " << argv[3] << "!" << endl;
+            return 1;
+        }
+        resultFile << setprecision(10);
+        for(int k = 0; k < (int)queries.size(); k++){
+            resultFile << distancesPre[k] << " " << distancesPost[k] << " " << distancesPost[k] - distancesPre[k] << "\n";
+        }
+        cout << "Wrote " << queries.size() << " results to " << argv[3] << endl;
+        return 0;
+    }
+
+    //Layout benchmark: ./run.exe --bench-layout
+    //times horizontal, vertical and diagonal paths on the row-major, 8x8 tiled and Z-order copies of the pre map
+    if(argc >= 2 && string(argv[1]) == "--bench-layout"){
+        benchmarkLayouts(dataPre);
+        return 0;
+    }
+
+    //Examples of the other query kinds on the default maps: ./run.exe --examples
+    if(argc >= 2 && string(argv[1]) == "--examples"){
+        //Kernel radius sensitivity, all radii evaluated in one pass over the path
+        vector<double> radii = {DefaultGrid::cellSize * sqrt(2), 60.0, 90.0, 120.0};
+        computeSurfaceDistancesMultiRadius(170, 340, 340, 340, radii, dataPre, dataPost);
+
+        //Threshold queries only need a yes/no, most get answered from bounds or stop partway down the path
+        HeightRangeTiles tilesPre = buildHeightRangeTiles(dataPre, 16);
+        cout << "Pre surface distance (170,340) -> (340,340) below 5500 m? " << surfaceDistanceBelow(170, 340, 340, 340, 5500.0, dataPre, tilesPre) << endl;
+        cout << "Pre surface distance (170,340) -> (340,340) below 5600 m? " << surfaceDistanceBelow(170, 340, 340, 340, 5600.0, dataPre, tilesPre) << endl << endl;
+
+        //Rows, columns and 45 degree diagonals can be answered in constant time from prefix tables, anything else goes to the walker
+        LinePrefixIndex lineIndexPre = buildLinePrefixIndex(dataPre);
+        cout << "Pre surface distance (170,340) -> (340,340) from the row table: " << computeSurfaceDistanceIndexed(170, 340, 340, 340, lineIndexPre, dataPre) << endl;
+        cout << "Pre surface distance (170,170) -> (340,340) from the diagonal table: " << computeSurfaceDistanceIndexed(170, 170, 340, 340, lineIndexPre, dataPre) << endl << endl;
+
+        //The boundary behavior is a choice of halo fill, only paths hugging the edge notice
+        const char* fillNames[4] = {"zero weight", "clamp", "mirror", "toroidal"};
+        for(int fill = HALO_ZERO_WEIGHT; fill <= HALO_TOROIDAL; fill++){
+            HaloRaster haloPre = buildHaloRaster(dataPre, 2, (HaloFill)fill);
+            cout << "Pre surface distance along the edge (0,0) -> (511,0) with " << fillNames[fill] << " halo: " << computeSurfaceDistance(0, 0, 511, 0, DefaultGrid::cellSize * sqrt(2), haloPre) << endl;
+        }
+        cout << endl;
+        return 0;
+    }
+
     //Query whichever points we want here!
-    computeSurfaceDistances(0, 0, 511, 511, dataPre, dataPost); //diagonal across whole map
-    computeSurfaceDistances(170, 170, 340, 340, dataPre, dataPost); //diagonal across middle 1/3rd diagonal
-    computeSurfaceDistances(170, 340, 340, 340, dataPre, dataPost); //roughly straight across peak
+    computeSurfaceDistances(0, 0, 511, 511, dataPre, dataPost, &changedTiles); //diagonal across whole map
+    computeSurfaceDistances(170, 170, 340, 340, dataPre, dataPost, &changedTiles); //diagonal across middle 1/3rd diagonal
+    computeSurfaceDistances(170, 340, 340, 340, dataPre, dataPost, &changedTiles); //roughly straight across peak
 
     filePre.close();
     filePost.close();
@@ -50,149 +348,134 @@ main(int argc, char* argv[]){
 /*=====================FUNCTIONS==========================*/
 
 //Compute distance from A to B for pre and post eruption data, then print each and their difference!
-double computeSurfaceDistances(int x1, int y1, int x2, int y2, vector<unsigned char>& dataPre, vector<unsigned char>& dataPost){
+//With changedTiles, post samples whose stencil doesn't touch a changed tile keep their pre height instead of being recomputed
+double computeSurfaceDistances(int x1, int y1, int x2, int y2, const vector<unsigned char>& dataPre, const vector<unsigned char>& dataPost, const ChangedTileIndex* changedTiles){
 
     cout << "Computing surface distance from pixel A = (" << x1 << "," << y1 << ") to pixel B = (" << x2 << ", " << y2 << ")" << endl;
 
     //Params
-    double rp = 30.0 * sqrt(2);
+    double rp = DefaultGrid::cellSize * sqrt(2);
 
     //-----Step 2: Generate points from A to B
 
-    Eigen::Vector3d A((double)x1 * 30.0 + 15.0, (double)y1 * 30.0 + 15.0, 0.0); //compute 3D location of A (cells are 30 m wide, pixels are cell-centered) -- fill height later since different between maps
-    Eigen::Vector3d B((double)x2 * 30.0 + 15.0, (double)y2 * 30.0 + 15.0, 0.0);
+    Eigen::Vector3d A(DefaultGrid::center(x1), DefaultGrid::center(y1), 0.0); //compute 3D location of A (cells are 30 m wide, pixels are cell-centered) -- fill height later since different between maps
+    Eigen::Vector3d B(DefaultGrid::center(x2), DefaultGrid::center(y2), 0.0);
 
-    //Now break line into segments of at LEAST length = rp = neighbor radius = 30 root 2
-    //We want as many quadrature points as possible while maintaining segmentLength > rp
-    Eigen::Vector3d direction = (B-A).normalized(); //normalized direction of path
-    double length = (B-A).norm(); //length of path
-    double segmentLength = length;
-    int numSegments = 1;
-    while(segmentLength > rp){
-        numSegments++;
-        segmentLength = length / (double)numSegments; 
-    }
-
-    //Construct path of points
-    vector<Eigen::Vector3d> queryPoints;
-    queryPoints.push_back(A);
-    for(int i = 1; i < numSegments; i++){
-        Eigen::Vector3d newP = A;
-        newP += (direction * segmentLength * (double)i);
-        queryPoints.push_back(newP);
-    }
-    queryPoints.push_back(B);
+    PathSampler path = makePathSampler(A, B, rp);
 
     //-----Step 3: Compute height at each point while racking up the surface distance as we go!
+    //Both maps are walked together so each sample is generated once and nothing about the path has to be kept around
     
     //Get 1-D index for 2D pixel coordinates
     int idxA = getIndex(x1, y1);
     int idxB = getIndex(x2, y2);
     
-    //First let's do this for PRE data
     double distancePre = 0.0;
-    for(int i = 0; i < (int)queryPoints.size(); i++){
-        if(i == 0){ //A
-            queryPoints[0][2] = (double)dataPre[idxA] * 11.0; //directly set A's height from the pixel data
-        }
-        else if(i == numSegments){ //B
-            queryPoints[i][2] = (double)dataPre[idxB] * 11.0; //directly set B's height from pixel data
-            Eigen::Vector3d currPoint = queryPoints[i];
-            Eigen::Vector3d prevPoint = queryPoints[i-1];
-            distancePre += (currPoint - prevPoint).norm();
+    double distancePost = 0.0;
+    Eigen::Vector3d prevPre = A;
+    Eigen::Vector3d prevPost = A;
+    prevPre[2] = (double)dataPre[idxA] * DefaultGrid::verticalScale; //directly set A's height from the pixel data
+    prevPost[2] = (double)dataPost[idxA] * DefaultGrid::verticalScale;
+    for(int i = 1; i <= path.numSegments; i++){
+        Eigen::Vector3d currPre = path[i];
+        Eigen::Vector3d currPost = currPre;
+        if(i == path.numSegments){ //B
+            currPre[2] = (double)dataPre[idxB] * DefaultGrid::verticalScale; //directly set B's height from pixel data
+            currPost[2] = (double)dataPost[idxB] * DefaultGrid::verticalScale;
         }
         else{
             //Compute Height Using Kernel
-            Eigen::Vector3d currPoint = queryPoints[i];
-            Eigen::Vector3d prevPoint = queryPoints[i-1];
-
-            computeHeight(currPoint, rp, dataPre);
-            queryPoints[i] = currPoint; //update this point to include height! because we grab i-1 to compare
-            
-            distancePre += (currPoint - prevPoint).norm();
+            computeHeight(currPre, rp, dataPre);
+            currPost[2] = currPre[2];
+            if(changedTiles == nullptr || stencilTouchesChange(currPost, rp, *changedTiles)){
+                computeHeight(currPost, rp, dataPost); //otherwise the pre height is the same
+            }
         }
+        distancePre += (currPre - prevPre).norm();
+        distancePost += (currPost - prevPost).norm();
+        prevPre = currPre;
+        prevPost = currPost;
     }
 
     cout << "Surface Distance Pre-Eruption: " << distancePre << endl;
 
-    //Now for the POST data!
-    double distancePost = 0.0;
-    for(int i = 0; i < (int)queryPoints.size(); i++){
-        if(i == 0){ //A
-            queryPoints[0][2] = (double)dataPost[idxA] * 11.0; //directly set A's height from the pixel data
-        }
-        else if(i == numSegments){ //B
-            queryPoints[i][2] = (double)dataPost[idxB] * 11.0; //directly set B's height from pixel data
-            Eigen::Vector3d currPoint = queryPoints[i];
-            Eigen::Vector3d prevPoint = queryPoints[i-1];
-            distancePost += (currPoint - prevPoint).norm();
-        }
-        else{
-            //Compute Height Using Kernel
-            Eigen::Vector3d currPoint = queryPoints[i];
-            Eigen::Vector3d prevPoint = queryPoints[i-1];
-
-            computeHeight(currPoint, rp, dataPost);
-            queryPoints[i] = currPoint; //update this point to include height! because we grab i-1 to compare
-            
-            distancePost += (currPoint - prevPoint).norm();
-        }
-    }
-
     cout << "Surface Distance Post-Eruption: " << distancePost << endl;
 
     cout << "Distance Post - Distance Pre: " << distancePost - distancePre << endl << endl;
-}
 
-int getIndex(int x, int y){
-    return x + (y * 512);
+    return distancePost - distancePre;
 }
 
-// Inspired by the scalar field construction done by Homel and Herbold 2016 to compute damage gradients in MPM
-// Free PDF on ResearchGate: https://www.researchgate.net/publication/303917651_Field-Gradient_Partitioning_for_Fracture_and_Frictional_Contact_in_the_Material_Point_Method
-// Check Equations 17 to 19
-void computeHeight(Eigen::Vector3d& p, double rp, vector<unsigned char>& data){
-    vector<int> idx;
-    idx = PointToGridIndeces(p); //get 2-D grid index --> which pixel is our query point inside?
-    int i = idx[0];
-    int j = idx[1];
-    double Hx = 0; //field num, H(x)
-    double Sx = 0; //field denom, S(x)
-    for(int r = i-2; r < i+3; r++){ //iterate the 5x5 stencil of neighbor cells 
-        for(int s = j-2; s < j+2; s++){
-            
-            //index filtering --> NO TOROIDAL BEHAVIOR HERE
-            if(r > 511 || s > 511 || r < 0 || s < 0){
-                continue;
-            }
+//Same as computeSurfaceDistances but for a whole set of kernel radii at once, prints one line per radius and returns the post - pre differences
+vector<double> computeSurfaceDistancesMultiRadius(int x1, int y1, int x2, int y2, const vector<double>& radii, const vector<unsigned char>& dataPre, const vector<unsigned char>& dataPost){
 
-            Eigen::Vector3d pixelPos((double)r * 30.0 + 15.0, (double)s * 30.0 + 15.0, 0.0);
-            int pixelIdx = getIndex(r, s);
-            double rBar = (p - pixelPos).norm() / rp;
-            double omega = 1 - (3 * rBar * rBar) + (2 * rBar * rBar * rBar);
-            if(rBar > 1.0){
-                omega = 0.0; //distance check is baked into rBar
-            }
-            double pixelHeight = (double)data[pixelIdx] * 11.0;
+    cout << "Computing surface distance from pixel A = (" << x1 << "," << y1 << ") to pixel B = (" << x2 << ", " << y2 << ") for " << radii.size() << " kernel radii" << endl;
+
+    vector<double> distancePre = computeSurfaceDistanceMultiRadius(x1, y1, x2, y2, radii, dataPre);
+    vector<double> distancePost = computeSurfaceDistanceMultiRadius(x1, y1, x2, y2, radii, dataPost);
 
-            Hx += pixelHeight * omega;
-            Sx += omega;
+    vector<double> diffs(radii.size());
+    for(int k = 0; k < (int)radii.size(); k++){
+        diffs[k] = distancePost[k] - distancePre[k];
+        cout << "rp = " << radii[k] << ": Pre " << distancePre[k] << ", Post " << distancePost[k] << ", Post - Pre " << diffs[k] << endl;
+    }
+    cout << endl;
+
+    return diffs;
+}
+
+//Copy a row-major map (as read from a .data file) into the grid's memory layout
+template<class Grid> vector<unsigned char> toLayout(const vector<unsigned char>& data, const Grid& grid){
+    vector<unsigned char> out(grid.numPixels);
+    for(int y = 0; y < grid.height; y++){
+        for(int x = 0; x < grid.width; x++){
+            out[grid.index(x, y)] = data[x + y * grid.width];
         }
     }
-    if(Sx > 0){
-        p[2] = Hx / Sx; //set height in the point
+    return out;
+}
+
+//Time one set of paths on one layout, returns nanoseconds per query (best of a few repeats)
+template<class Grid> double timePaths(const vector<Eigen::Vector4i>& paths, const vector<unsigned char>& data, const Grid& grid, double& checksum){
+    double rp = grid.cellSize * sqrt(2);
+    double best = 1e300;
+    for(int repeat = 0; repeat < 5; repeat++){
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        double sum = 0.0;
+        for(const Eigen::Vector4i& path : paths){
+            sum += computeSurfaceDistance(path[0], path[1], path[2], path[3], rp, data, grid);
+        }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (double)paths.size();
+        best = min(best, ns);
+        checksum = sum;
     }
-    
-    return;
+    return best;
 }
 
-//What pixel coordinate does this particle lie in?
-vector<int> PointToGridIndeces(Eigen::Vector3d p){
-    vector<int> idx(2,-1);
-    int i, j = 0;
-    i = floor(p[0]/30.0);
-    j = floor(p[1]/30.0);
-    idx[0] = i;
-    idx[1] = j;
-    return idx;
+//Compare the row-major, 8x8 tiled and Z-order layouts on horizontal, vertical and diagonal full-map paths
+void benchmarkLayouts(const vector<unsigned char>& data){
+    vector<unsigned char> tiled = toLayout(data, TiledGrid());
+    vector<unsigned char> morton = toLayout(data, MortonGrid());
+
+    const int last = DefaultGrid::width - 1;
+    const char* pathNames[3] = {"horizontal", "vertical", "diagonal"};
+    vector<Eigen::Vector4i> paths[3];
+    for(int k = 0; k <= last; k += 4){
+        paths[0].push_back(Eigen::Vector4i(0, k, last, k));
+        paths[1].push_back(Eigen::Vector4i(k, 0, k, last));
+        paths[2].push_back(Eigen::Vector4i(0, k, last - k, last)); //45 degrees, lengths vary
+    }
+
+    cout << left << setw(12) << "path" << setw(20) << "row-major ns/query" << setw(20) << "tiled 8x8 ns/query" << "z-order ns/query" << endl;
+    for(int d = 0; d < 3; d++){
+        double checkRow, checkTiled, checkMorton;
+        double row = timePaths(paths[d], data, DefaultGrid(), checkRow);
+        double tile = timePaths(paths[d], tiled, TiledGrid(), checkTiled);
+        double z = timePaths(paths[d], morton, MortonGrid(), checkMorton);
+        cout << setw(12) << pathNames[d] << setw(20) << row << setw(20) << tile << z;
+        if(checkRow != checkTiled || checkRow != checkMorton){
+            cout << "  (layouts disagree!)";
+        }
+        cout << endl;
+    }
 }
@@ -0,0 +1,309 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+//Synthetic terrain for testing at sizes the real data doesn't come in
+//
+//  ./generate.exe width height outPrefix [--seed n] [--roughness H] [--crater x y radius depth] [--format raw|tiled|both] [--threads n]
+//
+//Writes outPrefix_pre and outPrefix_post, 8 bit heights like the .data files. raw is row-major (.data), tiled is 8x8 blocks
+//stored one after the other, row-major inside a block and between blocks (.tiled, the TiledGrid layout), with the edges padded
+//to whole blocks. The post epoch is the pre one with a crater punched in, pixels away from it are byte for byte the same
+//
+//The terrain is diamond-square (midpoint displacement) on a 2^n+1 grid cropped to width x height. Every displacement comes
+//from a hash of (seed, level, x, y) instead of a random stream, so any band of rows can be generated on its own from a band of
+//the level above it. That's what makes it multithreaded and out-of-core: threads take bands of rows, and memory is a few
+//bands no matter the map size. The output only depends on the seed and parameters, never on the number of threads
+
+struct TerrainParams{
+    uint64_t seed;
+    double roughness;  //H, displacement shrinks by 2^-H per level. 0.5 is rough, 1 smooth
+    int levels;        //grid is 2^levels + 1 on a side
+};
+
+//Uniform in [-1,1), a pure function of its arguments
+static double displacement(uint64_t seed, int level, int64_t x, int64_t y){
+    uint64_t h = seed ^ ((uint64_t)level << 56) ^ ((uint64_t)x * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)y * 0xc2b2ae3d27d4eb4fULL);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (double)(h >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+}
+
+static double amplitude(const TerrainParams& params, int level){
+    return pow(2.0, -params.roughness * level);
+}
+
+//Rows y0..y1 of the grid at level (2^level + 1 wide), row after row
+//Each level refines the one above: even/even points are copied, the diamond step puts a center in every square and the square
+//step a point on every edge, each the average of its neighbors plus a displacement. Row y needs rows y/2 - 1 .. y/2 + 1 above
+static vector<float> generateRows(const TerrainParams& params, int level, int64_t y0, int64_t y1){
+    int64_t width = ((int64_t)1 << level) + 1;
+    vector<float> rows((size_t)((y1 - y0 + 1) * width));
+    if(level == 0){
+        for(int64_t y = y0; y <= y1; y++){
+            for(int64_t x = 0; x < 2; x++){
+                rows[(size_t)((y - y0) * width + x)] = (float)displacement(params.seed, 0, x, y);
+            }
+        }
+        return rows;
+    }
+
+    int64_t last = width - 1;
+    int64_t parentWidth = ((int64_t)1 << (level - 1)) + 1;
+    int64_t py0 = max((int64_t)0, y0 / 2 - 1);
+    int64_t py1 = min(parentWidth - 1, (y1 + 1) / 2 + 1);
+    vector<float> parent = generateRows(params, level - 1, py0, py1);
+    double amp = amplitude(params, level);
+    auto up = [&](int64_t px, int64_t py){
+        return (double)parent[(size_t)((py - py0) * parentWidth + px)];
+    };
+    auto center = [&](int64_t x, int64_t y){ //x and y odd
+        return 0.25 * (up((x - 1) / 2, (y - 1) / 2) + up((x + 1) / 2, (y - 1) / 2) + up((x - 1) / 2, (y + 1) / 2) + up((x + 1) / 2, (y + 1) / 2))
+               + amp * displacement(params.seed, level, x, y);
+    };
+
+    for(int64_t y = y0; y <= y1; y++){
+        float* row = &rows[(size_t)((y - y0) * width)];
+        for(int64_t x = 0; x <= last; x++){
+            double value;
+            if(!(x & 1) && !(y & 1)){
+                value = up(x / 2, y / 2);
+            }
+            else if((x & 1) && (y & 1)){
+                value = center(x, y);
+            }
+            else{
+                //edge point, two parent neighbors along the edge and up to two centers across it (fewer on the map border)
+                double sum;
+                int count = 2;
+                if(x & 1){
+                    sum = up((x - 1) / 2, y / 2) + up((x + 1) / 2, y / 2);
+                    if(y > 0){ sum += center(x, y - 1); count++; }
+                    if(y < last){ sum += center(x, y + 1); count++; }
+                }
+                else{
+                    sum = up(x / 2, (y - 1) / 2) + up(x / 2, (y + 1) / 2);
+                    if(x > 0){ sum += center(x - 1, y); count++; }
+                    if(x < last){ sum += center(x + 1, y); count++; }
+                }
+                value = sum / count + amp * displacement(params.seed, level, x, y);
+            }
+            row[x] = (float)value;
+        }
+    }
+    return rows;
+}
+
+//Height range of the whole map without generating it: every refinement averages its neighbors (stays inside their range)
+//and adds at most amp, so the full map is inside the range of a coarse level widened by the amplitudes of the levels below it
+static void heightBounds(const TerrainParams& params, double& low, double& high){
+    int coarse = min(params.levels, 10);
+    int64_t width = ((int64_t)1 << coarse) + 1;
+    vector<float> grid = generateRows(params, coarse, 0, width - 1);
+    low = *min_element(grid.begin(), grid.end());
+    high = *max_element(grid.begin(), grid.end());
+    for(int level = coarse + 1; level <= params.levels; level++){
+        low -= amplitude(params, level);
+        high += amplitude(params, level);
+    }
+}
+
+struct Crater{
+    double x, y;       //center, pixels
+    double radius;     //pixels
+    double depth;      //pixel values at the center
+};
+
+//Bowl down to depth inside radius with a raised rim around it, nothing changes past 1.6 radius
+static double craterChange(const Crater& crater, int64_t x, int64_t y){
+    double s = hypot((double)x - crater.x, (double)y - crater.y) / crater.radius;
+    if(s >= 1.6){
+        return 0.0;
+    }
+    double change = 0.25 * crater.depth * exp(-((s - 1.0) / 0.15) * ((s - 1.0) / 0.15));
+    if(s < 1.0){
+        change -= crater.depth * (1.0 - s * s);
+    }
+    return change;
+}
+
+static bool writeAll(int fd, const unsigned char* bytes, size_t size, off_t offset){
+    while(size > 0){
+        ssize_t written = pwrite(fd, bytes, size, offset);
+        if(written <= 0){
+            return false;
+        }
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+//Row-major band rows y0.. of a width x ? map -> the same rows in 8x8 blocks. Bands start on a block row, so the result is a
+//contiguous run of the tiled file
+static void toTiledBand(const vector<unsigned char>& band, int64_t width, int64_t numRows, vector<unsigned char>& tiled){
+    int64_t blocksPerRow = (width + 7) / 8;
+    int64_t blockRows = (numRows + 7) / 8;
+    tiled.assign((size_t)(blockRows * blocksPerRow * 64), 0);
+    for(int64_t y = 0; y < numRows; y++){
+        for(int64_t x = 0; x < width; x++){
+            int64_t block = (x >> 3) + (y >> 3) * blocksPerRow;
+            tiled[(size_t)((block << 6) | ((x & 7) + ((y & 7) << 3)))] = band[(size_t)(y * width + x)];
+        }
+    }
+}
+
+int main(int argc, char* argv[]){
+    if(argc < 4){
+        cerr << "Usage: " << argv[0] << " width height outPrefix [--seed n] [--roughness H] [--crater x y radius depth] [--format raw|tiled|both] [--threads n]" << endl;
+        return 1;
+    }
+    int64_t width = atoll(argv[1]);
+    int64_t height = atoll(argv[2]);
+    string prefix = argv[3];
+    TerrainParams params{1, 0.8, 0};
+    Crater crater{0.6 * width, 0.4 * height, max(4.0, width / 16.0), 60.0};
+    string format = "raw";
+    int numThreads = max(1, (int)thread::hardware_concurrency());
+    for(int a = 4; a < argc; a++){
+        string arg = argv[a];
+        if(arg == "--seed" && a + 1 < argc){
+            params.seed = strtoull(argv[++a], nullptr, 10);
+        }
+        else if(arg == "--roughness" && a + 1 < argc){
+            params.roughness = atof(argv[++a]);
+        }
+        else if(arg == "--crater" && a + 4 < argc){
+            crater = Crater{atof(argv[a + 1]), atof(argv[a + 2]), atof(argv[a + 3]), atof(argv[a + 4])};
+            a += 4;
+        }
+        else if(arg == "--format" && a + 1 < argc){
+            format = argv[++a];
+        }
+        else if(arg == "--threads" && a + 1 < argc){
+            numThreads = max(1, atoi(argv[++a]));
+        }
+        else{
+            cerr << "Unknown option " << arg << "!" << endl;
+            return 1;
+        }
+    }
+    if(width < 2 || height < 2 || width > (1 << 20) || height > (1 << 20) || crater.radius <= 0.0){
+        cerr << "Width and height must be 2 to 2^20 pixels and the crater radius positive!" << endl;
+        return 1;
+    }
+    if(format != "raw" && format != "tiled" && format != "both"){
+        cerr << "Format must be raw, tiled or both!" << endl;
+        return 1;
+    }
+    bool writeRaw = (format != "tiled");
+    bool writeTiled = (format != "raw");
+    while(((int64_t)1 << params.levels) + 1 < max(width, height)){
+        params.levels++;
+    }
+
+    //pre, post x raw, tiled
+    string names[2][2] = {{prefix + "_pre.data", prefix + "_pre.tiled"}, {prefix + "_post.data", prefix + "_post.tiled"}};
+    int files[2][2] = {{-1, -1}, {-1, -1}};
+    for(int epoch = 0; epoch < 2; epoch++){
+        for(int kind = 0; kind < 2; kind++){
+            if((kind == 0 && !writeRaw) || (kind == 1 && !writeTiled)){
+                continue;
+            }
+            files[epoch][kind] = open(names[epoch][kind].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(files[epoch][kind] < 0){
+                cerr << "Failed to create " << names[epoch][kind] << ": " << strerror(errno) << endl;
+                return 1;
+            }
+        }
+    }
+
+    double low, high;
+    heightBounds(params, low, high);
+    double toByte = 255.0 / (high - low);
+
+    //Threads take bands of rows in order, 64 rows (a multiple of the 8 row blocks) keep a band to a few MB even 64k wide
+    const int64_t bandRows = 64;
+    int64_t numBands = (height + bandRows - 1) / bandRows;
+    int64_t blocksPerRow = (width + 7) / 8;
+    atomic<int64_t> nextBand(0);
+    atomic<bool> failed(false);
+    atomic<int64_t> changedPixels(0);
+    auto work = [&](){
+        vector<unsigned char> pre, post, tiled;
+        int64_t changed = 0;
+        for(int64_t band = nextBand++; band < numBands && !failed; band = nextBand++){
+            int64_t y0 = band * bandRows;
+            int64_t numRows = min(bandRows, height - y0);
+            vector<float> rows = generateRows(params, params.levels, y0, y0 + numRows - 1);
+            int64_t gridWidth = ((int64_t)1 << params.levels) + 1;
+            pre.resize((size_t)(numRows * width));
+            post.resize(pre.size());
+            for(int64_t y = 0; y < numRows; y++){
+                for(int64_t x = 0; x < width; x++){
+                    double value = floor(((double)rows[(size_t)(y * gridWidth + x)] - low) * toByte + 0.5);
+                    unsigned char preValue = (unsigned char)min(255.0, max(0.0, value));
+                    double change = craterChange(crater, x, y0 + y);
+                    unsigned char postValue = preValue;
+                    if(change != 0.0){
+                        postValue = (unsigned char)min(255.0, max(0.0, floor((double)preValue + change + 0.5)));
+                        changed += (postValue != preValue);
+                    }
+                    pre[(size_t)(y * width + x)] = preValue;
+                    post[(size_t)(y * width + x)] = postValue;
+                }
+            }
+            for(int epoch = 0; epoch < 2; epoch++){
+                const vector<unsigned char>& band = (epoch == 0) ? pre : post;
+                if(files[epoch][0] >= 0 && !writeAll(files[epoch][0], band.data(), band.size(), (off_t)(y0 * width))){
+                    failed = true;
+                }
+                if(files[epoch][1] >= 0){
+                    toTiledBand(band, width, numRows, tiled);
+                    if(!writeAll(files[epoch][1], tiled.data(), tiled.size(), (off_t)((y0 / 8) * blocksPerRow * 64))){
+                        failed = true;
+                    }
+                }
+            }
+        }
+        changedPixels += changed;
+    };
+    vector<thread> threads;
+    for(int t = 0; t < numThreads; t++){
+        threads.emplace_back(work);
+    }
+    for(thread& t : threads){
+        t.join();
+    }
+
+    for(int epoch = 0; epoch < 2; epoch++){
+        for(int kind = 0; kind < 2; kind++){
+            if(files[epoch][kind] >= 0){
+                close(files[epoch][kind]);
+            }
+        }
+    }
+    if(failed){
+        cerr << "Failed to write the terrain files!" << endl;
+        return 1;
+    }
+    cout << "Wrote " << width << "x" << height << " terrain (seed " << params.seed << ", roughness " << params.roughness << ") to " << prefix << "_{pre,post}"
+         << (writeRaw && writeTiled ? ".{data,tiled}" : (writeRaw ? ".data" : ".tiled")) << ", crater changed " << changedPixels << " pixels" << endl;
+    return 0;
+}
@@ -0,0 +1,1859 @@
+#include <fstream>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <numeric>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <future>
+#include <stdlib.h>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "terrainDistance.h"
+
+using namespace std;
+
+//Surface distance from A to B on one map for every radius in radii, in one traversal of the path
+//The samples are shared between radii so they are spaced by the SMALLEST radius (every radius still sees segments no longer than itself),
+//and a single-radius call gives what computeSurfaceDistance gets for that rp to rounding (the kernel scales by 1/rp instead of
+//dividing and the segments are summed from their planar and vertical parts, about 1e-11 m apart on a full-map path)
+vector<double> computeSurfaceDistanceMultiRadius(int x1, int y1, int x2, int y2, const vector<double>& radii, MapView data){
+    int numRadii = (int)radii.size();
+    vector<double> distances(numRadii, 0.0);
+    if(numRadii == 0){
+        return distances;
+    }
+
+    double rMin = radii[0];
+    double rMax = radii[0];
+    Eigen::ArrayXd invRadii(numRadii);
+    for(int k = 0; k < numRadii; k++){
+        rMin = min(rMin, radii[k]);
+        rMax = max(rMax, radii[k]);
+        invRadii[k] = 1.0 / radii[k];
+    }
+
+    Eigen::Vector3d A(DefaultGrid::center(x1), DefaultGrid::center(y1), 0.0);
+    Eigen::Vector3d B(DefaultGrid::center(x2), DefaultGrid::center(y2), 0.0);
+    PathSampler path = makePathSampler(A, B, rMin);
+    TERRAIN_STAT(
+        countStat(STAT_QUERIES, (uint64_t)numRadii);
+        countStat(STAT_SAMPLES, (uint64_t)numRadii * (uint64_t)(path.numSegments - 1)); //one kernel pass serves every radius
+    )
+
+    //Endpoints come straight from the pixel data so they are the same for every radius
+    double heightA = (double)data[getIndex(x1, y1)] * DefaultGrid::verticalScale;
+    double heightB = (double)data[getIndex(x2, y2)] * DefaultGrid::verticalScale;
+
+    Eigen::ArrayXd prevHeights = Eigen::ArrayXd::Constant(numRadii, heightA);
+    Eigen::ArrayXd currHeights(numRadii);
+    Eigen::Vector3d prevPoint = path[0];
+    for(int i = 1; i <= path.numSegments; i++){
+        Eigen::Vector3d currPoint = path[i];
+        if(i == path.numSegments){ //B
+            currHeights.setConstant(heightB);
+        }
+        else{
+            currHeights = prevHeights; //kept by radii with no pixel in range, like computeHeight
+            computeHeightMultiRadius(currPoint, invRadii, rMax, data, currHeights);
+        }
+
+        //planar part of the segment is the same for every radius, only the rise differs
+        double planar2 = (currPoint - prevPoint).head<2>().squaredNorm();
+        prevPoint = currPoint;
+        for(int k = 0; k < numRadii; k++){
+            double rise = currHeights[k] - prevHeights[k];
+            distances[k] += sqrt(planar2 + rise * rise);
+        }
+        prevHeights = currHeights;
+    }
+
+    return distances;
+}
+
+//Kernel field for a radius of any size: every pixel whose center is within rp, where computeHeight's 5x4 stencil only
+//holds all of them for rp under 1.5 cells. p's height is only written if some pixel is in range, like computeHeight
+static void computeHeightWide(Eigen::Vector3d& p, double rp, MapView data){
+    int rLo = max(0, (int)ceil((p[0] - rp - DefaultGrid::halfCell) / DefaultGrid::cellSize));
+    int rHi = min(DefaultGrid::width - 1, (int)floor((p[0] + rp - DefaultGrid::halfCell) / DefaultGrid::cellSize));
+    int sLo = max(0, (int)ceil((p[1] - rp - DefaultGrid::halfCell) / DefaultGrid::cellSize));
+    int sHi = min(DefaultGrid::height - 1, (int)floor((p[1] + rp - DefaultGrid::halfCell) / DefaultGrid::cellSize));
+    double Hx = 0;
+    double Sx = 0;
+    for(int r = rLo; r <= rHi; r++){
+        for(int s = sLo; s <= sHi; s++){
+            double dx = p[0] - DefaultGrid::center(r);
+            double dy = p[1] - DefaultGrid::center(s);
+            double rBar = sqrt(dx * dx + dy * dy) / rp;
+            if(rBar > 1.0){
+                continue;
+            }
+            double omega = 1 - (3 * rBar * rBar) + (2 * rBar * rBar * rBar);
+            Hx += (double)data[getIndex(r, s)] * DefaultGrid::verticalScale * omega;
+            Sx += omega;
+        }
+    }
+    if(Sx > 0){
+        p[2] = Hx / Sx;
+    }
+}
+
+//Surface distance from A to B with the sample spacing set apart from the kernel radius: equal segments no longer than maxStep
+//For measuring what the spacing and radius cost in accuracy, maxStep = rp is exactly computeSurfaceDistance
+double computeSurfaceDistanceSampled(int x1, int y1, int x2, int y2, double rp, double maxStep, MapView data){
+    Eigen::Vector3d A(DefaultGrid::center(x1), DefaultGrid::center(y1), 0.0);
+    Eigen::Vector3d B(DefaultGrid::center(x2), DefaultGrid::center(y2), 0.0);
+    PathSampler path = makePathSampler(A, B, maxStep);
+    bool fitsStencil = (rp < 1.5 * DefaultGrid::cellSize);
+    Eigen::Vector3d prevPoint = A;
+    prevPoint[2] = (double)data[getIndex(x1, y1)] * DefaultGrid::verticalScale;
+
+    double distance = 0.0;
+    for(int i = 1; i <= path.numSegments; i++){
+        Eigen::Vector3d currPoint = path[i];
+        if(i < path.numSegments){
+            currPoint[2] = prevPoint[2];
+            if(fitsStencil){
+                computeHeight(currPoint, rp, data);
+            }
+            else{
+                computeHeightWide(currPoint, rp, data);
+            }
+        }
+        else{
+            currPoint[2] = (double)data[getIndex(x2, y2)] * DefaultGrid::verticalScale;
+        }
+        distance += (currPoint - prevPoint).norm();
+        prevPoint = currPoint;
+    }
+    return distance;
+}
+
+//Break the line from A to B into equal segments no longer than rp, the points themselves come from the sampler on demand
+//We want as many quadrature points as possible while maintaining segmentLength <= rp
+PathSampler makePathSampler(const Eigen::Vector3d& A, const Eigen::Vector3d& B, double rp){
+    PathSampler path;
+    path.A = A;
+    path.B = B;
+    Eigen::Vector3d direction = (B-A).normalized(); //normalized direction of path
+    double length = (B-A).norm(); //length of path
+    path.numSegments = countSegments(length, rp);
+    path.segmentLength = length / (double)path.numSegments;
+    path.step = direction * path.segmentLength;
+    return path;
+}
+
+//Surface distance from pixel (x0,y0) to EVERY pixel, for both maps
+//Targets are grouped by primitive direction (dx,dy)/gcd(dx,dy) so every target on a ray from the origin is a multiple of the same step.
+//Each pixel step along the ray is split into q equal segments no longer than rp, which puts every target exactly on a sample,
+//so one walk down the ray gives the distance to all of its targets: kernel samples up to the one before the target, then the target's own pixel height (like B in computeSurfaceDistances)
+//Rays are split into contiguous angular sectors, one per thread; each pixel lies on exactly one ray so the threads never write the same entry
+void computeSurfaceDistanceMap(int x0, int y0, MapView dataPre, MapView dataPost, vector<float>& mapPre, vector<float>& mapPost, vector<float>& mapDiff, int numThreads){
+    double rp = DefaultGrid::cellSize * sqrt(2);
+
+    mapPre.assign(DefaultGrid::numPixels, 0.0f);
+    mapPost.assign(DefaultGrid::numPixels, 0.0f);
+    mapDiff.assign(DefaultGrid::numPixels, 0.0f);
+
+    //Collect every primitive direction that has at least one target in the map, with its sample count for load balancing
+    struct Ray{
+        int dx, dy;
+        int numTargets; //targets at origin + m*(dx,dy), m = 1..numTargets
+        int q;          //segments per pixel step
+        double angle;
+    };
+    vector<Ray> rays;
+    for(int y = 0; y < DefaultGrid::height; y++){
+        for(int x = 0; x < DefaultGrid::width; x++){
+            int dx = x - x0;
+            int dy = y - y0;
+            if((dx == 0 && dy == 0) || gcd(abs(dx), abs(dy)) != 1){
+                continue; //origin, or not the first pixel of its ray
+            }
+            Ray ray;
+            ray.dx = dx;
+            ray.dy = dy;
+            ray.numTargets = 1;
+            while(true){
+                int xm = x0 + dx * (ray.numTargets + 1);
+                int ym = y0 + dy * (ray.numTargets + 1);
+                if(xm < 0 || xm >= DefaultGrid::width || ym < 0 || ym >= DefaultGrid::height){
+                    break;
+                }
+                ray.numTargets++;
+            }
+            double stepLength = DefaultGrid::cellSize * sqrt((double)(dx * dx + dy * dy));
+            ray.q = 1;
+            while(stepLength / (double)ray.q > rp){
+                ray.q++;
+            }
+            ray.angle = atan2((double)dy, (double)dx);
+            rays.push_back(ray);
+        }
+    }
+    sort(rays.begin(), rays.end(), [](const Ray& a, const Ray& b){ return a.angle < b.angle; });
+
+    //Walk one ray on both maps and fill in all of its targets
+    Eigen::Vector3d O(DefaultGrid::center(x0), DefaultGrid::center(y0), 0.0);
+    double heightOPre = (double)dataPre[getIndex(x0, y0)] * DefaultGrid::verticalScale;
+    double heightOPost = (double)dataPost[getIndex(x0, y0)] * DefaultGrid::verticalScale;
+    auto walkRay = [&](const Ray& ray){
+        Eigen::Vector3d step(ray.dx * DefaultGrid::cellSize / (double)ray.q, ray.dy * DefaultGrid::cellSize / (double)ray.q, 0.0);
+        double planar2 = step.squaredNorm();
+
+        double distancePre = 0.0;
+        double distancePost = 0.0;
+        double prevPre = heightOPre;
+        double prevPost = heightOPost;
+        int numSamples = ray.numTargets * ray.q;
+        TERRAIN_STAT(countStat(STAT_QUERIES, 2 * (uint64_t)ray.numTargets);)
+        for(int k = 1; k <= numSamples; k++){
+            if(k % ray.q == 0){ //target pixel, ends the path from the origin with its own height
+                int m = k / ray.q;
+                int idx = getIndex(x0 + ray.dx * m, y0 + ray.dy * m);
+                double risePre = (double)dataPre[idx] * DefaultGrid::verticalScale - prevPre;
+                double risePost = (double)dataPost[idx] * DefaultGrid::verticalScale - prevPost;
+                float dPre = (float)(distancePre + sqrt(planar2 + risePre * risePre));
+                float dPost = (float)(distancePost + sqrt(planar2 + risePost * risePost));
+                mapPre[idx] = dPre;
+                mapPost[idx] = dPost;
+                mapDiff[idx] = dPost - dPre;
+                if(m == ray.numTargets){
+                    break; //no need for the kernel height past the last target
+                }
+            }
+
+            //Kernel height at this sample so the path can keep going past it
+            double heightPre = prevPre;
+            double heightPost = prevPost;
+            computeHeightBothEpochs(O + step * (double)k, rp, dataPre, dataPost, heightPre, heightPost);
+            double risePre = heightPre - prevPre;
+            double risePost = heightPost - prevPost;
+            distancePre += sqrt(planar2 + risePre * risePre);
+            distancePost += sqrt(planar2 + risePost * risePost);
+            prevPre = heightPre;
+            prevPost = heightPost;
+        }
+    };
+
+    //Split the sorted rays into angular sectors with roughly equal sample counts
+    numThreads = max(1, numThreads);
+    long totalSamples = 0;
+    for(const Ray& ray : rays){
+        totalSamples += (long)ray.numTargets * ray.q;
+    }
+    vector<int> sectorStart(1, 0);
+    long runningSamples = 0;
+    for(int r = 0; r < (int)rays.size(); r++){
+        runningSamples += (long)rays[r].numTargets * rays[r].q;
+        if((int)sectorStart.size() < numThreads && runningSamples * numThreads >= totalSamples * (long)sectorStart.size()){
+            sectorStart.push_back(r + 1);
+        }
+    }
+    sectorStart.push_back((int)rays.size());
+
+    vector<thread> workers;
+    TERRAIN_STAT(vector<QueryStats> workerStats(sectorStart.size());)
+    for(int t = 0; t + 1 < (int)sectorStart.size(); t++){
+        int begin = sectorStart[t];
+        int end = sectorStart[t+1];
+        workers.emplace_back([&, t, begin, end](){
+            for(int r = begin; r < end; r++){
+                walkRay(rays[r]);
+            }
+            TERRAIN_STAT(workerStats[t] = takeThreadQueryStats();)
+        });
+    }
+    for(thread& worker : workers){
+        worker.join();
+    }
+    TERRAIN_STAT(for(const QueryStats& stats : workerStats){ addThreadQueryStats(stats); })
+}
+
+//Dump a 512x512 float raster as raw binary, same layout as the input .data files
+bool writeFloatRaster(const string& fileName, const vector<float>& raster){
+    ofstream file(fileName, ios::binary);
+    if(!file.is_open()){
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(raster.data()), raster.size() * sizeof(float));
+    return (bool)file;
+}
+
+//Distance from A to B on both maps without printing anything, the samples and stencil weights are shared between the maps
+void computeSurfaceDistancePair(int x1, int y1, int x2, int y2, double rp, MapView dataPre, MapView dataPost, double& distancePre, double& distancePost){
+    Eigen::Vector3d A(DefaultGrid::center(x1), DefaultGrid::center(y1), 0.0);
+    Eigen::Vector3d B(DefaultGrid::center(x2), DefaultGrid::center(y2), 0.0);
+    PathSampler path = makePathSampler(A, B, rp);
+
+    distancePre = 0.0;
+    distancePost = 0.0;
+    double prevPre = (double)dataPre[getIndex(x1, y1)] * DefaultGrid::verticalScale;
+    double prevPost = (double)dataPost[getIndex(x1, y1)] * DefaultGrid::verticalScale;
+    Eigen::Vector3d prevPoint = path[0];
+    TERRAIN_STAT(uint64_t tiles = 0; long tile = -1;)
+    for(int i = 1; i <= path.numSegments; i++){
+        Eigen::Vector3d currPoint = path[i];
+        double heightPre = prevPre;
+        double heightPost = prevPost;
+        if(i == path.numSegments){ //B
+            heightPre = (double)dataPre[getIndex(x2, y2)] * DefaultGrid::verticalScale;
+            heightPost = (double)dataPost[getIndex(x2, y2)] * DefaultGrid::verticalScale;
+        }
+        else{
+            computeHeightBothEpochs(currPoint, rp, dataPre, dataPost, heightPre, heightPost);
+            TERRAIN_STAT(
+                long cellTile = ((long)floor(currPoint[1]/DefaultGrid::cellSize) >> 3) * (1L << 32) + ((long)floor(currPoint[0]/DefaultGrid::cellSize) >> 3);
+                if(cellTile != tile){
+                    tiles++;
+                    tile = cellTile;
+                }
+            )
+        }
+        double planar2 = (currPoint - prevPoint).head<2>().squaredNorm();
+        prevPoint = currPoint;
+        distancePre += sqrt(planar2 + (heightPre - prevPre) * (heightPre - prevPre));
+        distancePost += sqrt(planar2 + (heightPost - prevPost) * (heightPost - prevPost));
+        prevPre = heightPre;
+        prevPost = heightPost;
+    }
+    TERRAIN_STAT(
+        countStat(STAT_QUERIES, 2);
+        countStat(STAT_TILES_FAULTED, 2 * tiles); //one tile per map
+    )
+}
+
+//All pairwise surface distances between points, for both maps. matrixPre/matrixPost come back dense NxN row-major and symmetric
+//Only the N(N-1)/2 pairs above the diagonal are computed (A->B and B->A sample the same line) and mirrored.
+//The points are sorted along a Z-order curve and the pairs are cut into TILE x TILE blocks of that order, so a block is a
+//bunch of paths between two small neighborhoods that mostly read the same stencil pixels; threads pull blocks off a shared counter
+void computeSurfaceDistanceMatrix(const vector<Eigen::Vector2i>& points, MapView dataPre, MapView dataPost, vector<float>& matrixPre, vector<float>& matrixPost, int numThreads){
+    const int TILE = 16;
+    double rp = DefaultGrid::cellSize * sqrt(2);
+    int n = (int)points.size();
+
+    matrixPre.assign((size_t)n * n, 0.0f);
+    matrixPost.assign((size_t)n * n, 0.0f);
+
+    vector<int> order(n);
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&](int a, int b){ return mortonKey(points[a][0], points[a][1]) < mortonKey(points[b][0], points[b][1]); });
+
+    //upper triangle of blocks, row by row
+    int numBlocks = (n + TILE - 1) / TILE;
+    vector<Eigen::Vector2i> blocks;
+    for(int bi = 0; bi < numBlocks; bi++){
+        for(int bj = bi; bj < numBlocks; bj++){
+            blocks.push_back(Eigen::Vector2i(bi, bj));
+        }
+    }
+
+    atomic<int> nextBlock(0);
+    auto worker = [&](){
+        while(true){
+            int b = nextBlock++;
+            if(b >= (int)blocks.size()){
+                break;
+            }
+            int iEnd = min(n, (blocks[b][0] + 1) * TILE);
+            int jEnd = min(n, (blocks[b][1] + 1) * TILE);
+            for(int i = blocks[b][0] * TILE; i < iEnd; i++){
+                for(int j = max(i + 1, blocks[b][1] * TILE); j < jEnd; j++){
+                    int a = order[i];
+                    int c = order[j];
+                    double distancePre, distancePost;
+                    computeSurfaceDistancePair(points[a][0], points[a][1], points[c][0], points[c][1], rp, dataPre, dataPost, distancePre, distancePost);
+                    matrixPre[(size_t)a * n + c] = matrixPre[(size_t)c * n + a] = (float)distancePre;
+                    matrixPost[(size_t)a * n + c] = matrixPost[(size_t)c * n + a] = (float)distancePost;
+                }
+            }
+        }
+    };
+
+    vector<thread> workers;
+    TERRAIN_STAT(vector<QueryStats> workerStats(max(1, numThreads));)
+    for(int t = 0; t < max(1, numThreads); t++){
+        workers.emplace_back([&, t](){
+            worker();
+            TERRAIN_STAT(workerStats[t] = takeThreadQueryStats();)
+        });
+    }
+    for(thread& w : workers){
+        w.join();
+    }
+    TERRAIN_STAT(for(const QueryStats& stats : workerStats){ addThreadQueryStats(stats); })
+}
+
+//Many short independent queries at once, one per SIMD lane: each lane holds its own query and sample, and all lanes
+//step down their paths in lockstep so the kernel math runs on LANES samples per instruction (Eigen fixed-size arrays).
+//Only the pixel gathers are per lane. When a lane's path ends its result is written out and the lane picks up the next
+//query, lanes with nothing left to do are masked out. Both maps go through together so the weights are only computed
+//once (like computeHeightBothEpochs). Same samples and heights as computeSurfaceDistance
+//which holds the indices into queries to run, distancesPre/Post[which[k]] get the results
+void computeSurfaceDistancePacked(const vector<SurfaceQuery>& queries, const vector<int>& which, MapView dataPre, MapView dataPost, vector<double>& distancesPre, vector<double>& distancesPost){
+    typedef Eigen::Array<double, LANES, 1> LaneArray;
+    typedef Eigen::Array<int, LANES, 1> LaneIndex;
+    double rp = DefaultGrid::cellSize * sqrt(2);
+    double invRp = 1.0 / rp;
+
+    //per lane path state, structure of arrays
+    LaneArray ax, ay, stepX, stepY;    //start point and per-segment step
+    LaneArray prevX, prevY, prevPre, prevPost;   //last sample
+    LaneArray k, numSegments;                    //current sample index, segments in the path
+    LaneArray bx, by, bPre, bPost;               //end point and its pixel heights
+    LaneArray active = LaneArray::Zero();
+    LaneArray distancePre = LaneArray::Zero();
+    LaneArray distancePost = LaneArray::Zero();
+    int query[LANES];
+    int next = 0;
+
+    //start lane l on the next query, or mask it out if there are none left
+    auto refill = [&](int l){
+        if(next >= (int)which.size()){
+            active[l] = 0.0;
+            ax[l] = ay[l] = bx[l] = by[l] = prevX[l] = prevY[l] = DefaultGrid::halfCell; //somewhere harmless
+            stepX[l] = stepY[l] = 0.0;
+            k[l] = 0.0;
+            numSegments[l] = 1.0;
+            return;
+        }
+        query[l] = which[next++];
+        const SurfaceQuery& q = queries[query[l]];
+        Eigen::Vector3d A(DefaultGrid::center(q.x1), DefaultGrid::center(q.y1), 0.0);
+        Eigen::Vector3d B(DefaultGrid::center(q.x2), DefaultGrid::center(q.y2), 0.0);
+        Eigen::Vector3d direction = (B-A).normalized();
+        double length = (B-A).norm();
+        int n = countSegments(length, rp);
+        double segmentLength = length / (double)n;
+        //coarse: every lane gathers the 3x3 around its sample for both maps, and the kernel doesn't track tiles
+        TERRAIN_STAT(
+            countStat(STAT_QUERIES, 2);
+            countStat(STAT_SAMPLES, 2 * (uint64_t)(n - 1));
+            countStat(STAT_STENCIL_VISITED, 18 * (uint64_t)(n - 1));
+            countStat(STAT_BYTES_READ, 18 * (uint64_t)(n - 1));
+        )
+        active[l] = 1.0;
+        ax[l] = prevX[l] = A[0];
+        ay[l] = prevY[l] = A[1];
+        stepX[l] = direction[0] * segmentLength;
+        stepY[l] = direction[1] * segmentLength;
+        bx[l] = B[0];
+        by[l] = B[1];
+        prevPre[l] = (double)dataPre[getIndex(q.x1, q.y1)] * DefaultGrid::verticalScale;
+        prevPost[l] = (double)dataPost[getIndex(q.x1, q.y1)] * DefaultGrid::verticalScale;
+        bPre[l] = (double)dataPre[getIndex(q.x2, q.y2)] * DefaultGrid::verticalScale;
+        bPost[l] = (double)dataPost[getIndex(q.x2, q.y2)] * DefaultGrid::verticalScale;
+        k[l] = 1.0;
+        numSegments[l] = (double)n;
+        distancePre[l] = 0.0;
+        distancePost[l] = 0.0;
+    };
+    for(int l = 0; l < LANES; l++){
+        refill(l);
+    }
+
+    while((active > 0.0).any()){
+        //sample position, B itself for lanes on their last segment
+        LaneArray atEnd = (k >= numSegments).cast<double>();
+        LaneArray px = (atEnd > 0.0).select(bx, ax + stepX * k);
+        LaneArray py = (atEnd > 0.0).select(by, ay + stepY * k);
+        LaneArray ci = (px / DefaultGrid::cellSize).floor();
+        LaneArray cj = (py / DefaultGrid::cellSize).floor();
+
+        //kernel, all lanes at once. computeHeight walks a 5x4 stencil but with rp = 30 root 2 < 1.5 cells the outer ring is
+        //always more than rp away (zero weight), so only the 3x3 around the sample's cell can contribute
+        LaneArray HxPre = LaneArray::Zero();
+        LaneArray HxPost = LaneArray::Zero();
+        LaneArray Sx = LaneArray::Zero();
+        for(int a = -1; a <= 1; a++){
+            LaneArray r = ci + (double)a;
+            LaneArray dx = px - (r * DefaultGrid::cellSize + DefaultGrid::halfCell);
+            LaneArray rValid = ((r >= 0.0) && (r < (double)DefaultGrid::width)).cast<double>();
+            LaneArray rClamped = r.max(0.0).min((double)(DefaultGrid::width - 1));
+            for(int b = -1; b <= 1; b++){
+                LaneArray sCell = cj + (double)b;
+                LaneArray dy = py - (sCell * DefaultGrid::cellSize + DefaultGrid::halfCell);
+                LaneArray rBar = (dx * dx + dy * dy).sqrt() * invRp;
+                LaneArray valid = rValid * ((sCell >= 0.0) && (sCell < (double)DefaultGrid::height)).cast<double>();
+                LaneArray omega = (rBar > 1.0).select(LaneArray::Zero(), 1.0 - 3.0 * rBar * rBar + 2.0 * rBar * rBar * rBar) * valid;
+                LaneArray sClamped = sCell.max(0.0).min((double)(DefaultGrid::height - 1));
+
+                //the gather is the only per-lane step, clamped so it never reads off the map (those cells have no weight anyway)
+                LaneIndex pixelIdx = (rClamped + sClamped * (double)DefaultGrid::width).cast<int>();
+                LaneArray pixelPre, pixelPost;
+                for(int l = 0; l < LANES; l++){
+                    pixelPre[l] = (double)dataPre[pixelIdx[l]];
+                    pixelPost[l] = (double)dataPost[pixelIdx[l]];
+                }
+                HxPre += pixelPre * DefaultGrid::verticalScale * omega;
+                HxPost += pixelPost * DefaultGrid::verticalScale * omega;
+                Sx += omega;
+            }
+        }
+        LaneArray heightPre = (atEnd > 0.0).select(bPre, (Sx > 0.0).select(HxPre / Sx, prevPre));
+        LaneArray heightPost = (atEnd > 0.0).select(bPost, (Sx > 0.0).select(HxPost / Sx, prevPost));
+
+        LaneArray segX = px - prevX;
+        LaneArray segY = py - prevY;
+        LaneArray flat = segX * segX + segY * segY;
+        LaneArray risePre = heightPre - prevPre;
+        LaneArray risePost = heightPost - prevPost;
+        distancePre += active * (flat + risePre * risePre).sqrt();
+        distancePost += active * (flat + risePost * risePost).sqrt();
+        prevX = px;
+        prevY = py;
+        prevPre = heightPre;
+        prevPost = heightPost;
+        k += 1.0;
+
+        //finished lanes hand in their result and take the next query
+        for(int l = 0; l < LANES; l++){
+            if(active[l] > 0.0 && atEnd[l] > 0.0){
+                distancesPre[query[l]] = distancePre[l];
+                distancesPost[query[l]] = distancePost[l];
+                refill(l);
+            }
+        }
+    }
+}
+
+//Distance on both maps for a big batch of queries, results come back in the same order as queries
+//Random queries hop all over the map and keep evicting each other's stencil pixels from cache (and TLB on big maps),
+//so the queries are run sorted by the Hilbert key of their midpoint instead: consecutive queries sit near each other and
+//reuse hot data. Each thread gets a contiguous run of that order, i.e. one compact region of the map
+//Short queries skip the per-query path and go through the packed LANES-wide kernel instead (AVX builds)
+void computeSurfaceDistanceBatch(const vector<SurfaceQuery>& queries, MapView dataPre, MapView dataPost, vector<double>& distancesPre, vector<double>& distancesPost, int numThreads){
+    double rp = DefaultGrid::cellSize * sqrt(2);
+    int n = (int)queries.size();
+    distancesPre.assign(n, 0.0);
+    distancesPost.assign(n, 0.0);
+
+    vector<pair<unsigned int, int>> order(n);
+    for(int k = 0; k < n; k++){
+        const SurfaceQuery& q = queries[k];
+        order[k] = make_pair(hilbertKey((q.x1 + q.x2) / 2, (q.y1 + q.y2) / 2, DefaultGrid::log2Width), k);
+    }
+    sort(order.begin(), order.end());
+
+    numThreads = max(1, min(numThreads, n));
+    vector<thread> workers;
+    TERRAIN_STAT(vector<QueryStats> workerStats(numThreads);)
+    for(int t = 0; t < numThreads; t++){
+        int begin = (int)((long)n * t / numThreads);
+        int end = (int)((long)n * (t + 1) / numThreads);
+        workers.emplace_back([&, t, begin, end](){
+            vector<int> shortQueries;
+            for(int o = begin; o < end; o++){
+                int k = order[o].second; //write back to the query's original slot
+                const SurfaceQuery& q = queries[k];
+                if(PACK_SHORT_QUERIES && max(abs(q.x2 - q.x1), abs(q.y2 - q.y1)) <= PACKED_MAX_PIXELS){
+                    shortQueries.push_back(k); //per-query overhead dominates these, run them LANES at a time below
+                    continue;
+                }
+                computeSurfaceDistancePair(q.x1, q.y1, q.x2, q.y2, rp, dataPre, dataPost, distancesPre[k], distancesPost[k]);
+            }
+            computeSurfaceDistancePacked(queries, shortQueries, dataPre, dataPost, distancesPre, distancesPost);
+            TERRAIN_STAT(workerStats[t] = takeThreadQueryStats();)
+        });
+    }
+    for(thread& worker : workers){
+        worker.join();
+    }
+    TERRAIN_STAT(for(const QueryStats& stats : workerStats){ addThreadQueryStats(stats); })
+}
+
+//Position of (x,y) along the Hilbert curve filling a 2^log2Size square. Unlike Z-order the curve never jumps,
+//so neighbors in the key are always neighbors on the map
+unsigned int hilbertKey(int x, int y, int log2Size){
+    unsigned int key = 0;
+    for(int s = 1 << (log2Size - 1); s > 0; s >>= 1){
+        int rx = (x & s) > 0;
+        int ry = (y & s) > 0;
+        key += (unsigned int)s * (unsigned int)s * (unsigned int)((3 * rx) ^ ry);
+        //rotate the quadrant so the sub-curve lines up
+        if(ry == 0){
+            if(rx == 1){
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            swap(x, y);
+        }
+    }
+    return key;
+}
+
+//Write an NxN matrix as raw floats, either all of it or just the strict upper triangle row by row
+bool writeDistanceMatrix(const string& fileName, const vector<float>& matrix, int n, bool upperTriangular){
+    ofstream file(fileName, ios::binary);
+    if(!file.is_open()){
+        return false;
+    }
+    if(!upperTriangular){
+        file.write(reinterpret_cast<const char*>(matrix.data()), matrix.size() * sizeof(float));
+    }
+    else{
+        for(int i = 0; i + 1 < n; i++){
+            file.write(reinterpret_cast<const char*>(&matrix[(size_t)i * n + i + 1]), (n - i - 1) * sizeof(float));
+        }
+    }
+    return (bool)file;
+}
+
+//Fewest equal segments that are each no longer than rp, i.e. the smallest n with length/n <= rp
+//ceil(length/rp) is that n up to rounding in the division, so nudge it with the exact test used on the segments
+int countSegments(double length, double rp){
+    if(!(length > rp)){
+        return 1;
+    }
+    int numSegments = (int)ceil(length / rp);
+    while(length / (double)numSegments > rp){
+        numSegments++;
+    }
+    while(numSegments > 1 && length / (double)(numSegments - 1) <= rp){
+        numSegments--;
+    }
+    return numSegments;
+}
+
+//Min and max pixel value over each tileSize x tileSize tile of the map (edge tiles may be partial)
+HeightRangeTiles buildHeightRangeTiles(MapView data, int tileSize){
+    HeightRangeTiles tiles;
+    tiles.tileSize = tileSize;
+    tiles.tilesPerSide = (DefaultGrid::width + tileSize - 1) / tileSize;
+    tiles.minValue.assign(tiles.tilesPerSide * tiles.tilesPerSide, 255);
+    tiles.maxValue.assign(tiles.tilesPerSide * tiles.tilesPerSide, 0);
+    for(int y = 0; y < DefaultGrid::height; y++){
+        for(int x = 0; x < DefaultGrid::width; x++){
+            int t = (x / tileSize) + (y / tileSize) * tiles.tilesPerSide;
+            unsigned char value = data[getIndex(x, y)];
+            tiles.minValue[t] = min(tiles.minValue[t], value);
+            tiles.maxValue[t] = max(tiles.maxValue[t], value);
+        }
+    }
+    return tiles;
+}
+
+//Is the surface distance from A to B (as computeSurfaceDistances would get it) strictly below limit?
+//1. the planar distance |B-A| is a lower bound since every segment is at least as long as its planar part
+//2. every sample height is a weighted average of pixels within the stencil, so no segment can rise more than the
+//   height range of the bounding box (grown by the 2 pixel stencil reach); that max slope gives n*sqrt(seg^2 + range^2) as an upper bound.
+//   The range comes from the precomputed tiles so both bounds are cheap
+//3. otherwise walk the path, giving up as soon as distance so far + planar distance left already reaches the limit
+bool surfaceDistanceBelow(int x1, int y1, int x2, int y2, double limit, MapView data, const HeightRangeView& tiles){
+    double rp = DefaultGrid::cellSize * sqrt(2);
+    TERRAIN_STAT(countStat(STAT_QUERIES, 1);) //samples only if the bounds don't settle it
+
+    Eigen::Vector3d A(DefaultGrid::center(x1), DefaultGrid::center(y1), 0.0);
+    Eigen::Vector3d B(DefaultGrid::center(x2), DefaultGrid::center(y2), 0.0);
+    double length = (B-A).norm();
+    if(length >= limit){
+        return false;
+    }
+
+    int tx0 = max(0, min(x1, x2) - 2) / tiles.tileSize;
+    int tx1 = min(DefaultGrid::width - 1, max(x1, x2) + 2) / tiles.tileSize;
+    int ty0 = max(0, min(y1, y2) - 2) / tiles.tileSize;
+    int ty1 = min(DefaultGrid::height - 1, max(y1, y2) + 2) / tiles.tileSize;
+    int lowest = 255;
+    int highest = 0;
+    for(int ty = ty0; ty <= ty1; ty++){
+        for(int tx = tx0; tx <= tx1; tx++){
+            lowest = min(lowest, (int)tiles.minValue[tx + ty * tiles.tilesPerSide]);
+            highest = max(highest, (int)tiles.maxValue[tx + ty * tiles.tilesPerSide]);
+        }
+    }
+    double heightRange = (double)(highest - lowest) * DefaultGrid::verticalScale;
+    PathSampler path = makePathSampler(A, B, rp);
+    int numSegments = path.numSegments;
+    double segmentLength = path.segmentLength;
+    if((double)numSegments * sqrt(segmentLength * segmentLength + heightRange * heightRange) < limit){
+        return true;
+    }
+
+    //Bounds didn't settle it, accumulate with early exit
+    double distance = 0.0;
+    double prevHeight = (double)data[getIndex(x1, y1)] * DefaultGrid::verticalScale;
+    Eigen::Vector3d prevPoint = path[0];
+    for(int i = 1; i <= numSegments; i++){
+        Eigen::Vector3d currPoint = path[i];
+        currPoint[2] = prevHeight;
+        if(i == numSegments){ //B
+            currPoint[2] = (double)data[getIndex(x2, y2)] * DefaultGrid::verticalScale;
+        }
+        else{
+            computeHeight(currPoint, rp, data);
+        }
+        double planar2 = (currPoint - prevPoint).head<2>().squaredNorm();
+        distance += sqrt(planar2 + (currPoint[2] - prevHeight) * (currPoint[2] - prevHeight));
+        prevHeight = currPoint[2];
+        prevPoint = currPoint;
+
+        if(distance + (double)(numSegments - i) * segmentLength >= limit){
+            return false;
+        }
+    }
+    return distance < limit;
+}
+
+//Mark every tileSize x tileSize tile where the two maps differ
+ChangedTileIndex buildChangedTileIndex(MapView dataPre, MapView dataPost, int tileSize){
+    ChangedTileIndex changedTiles;
+    changedTiles.tileSize = tileSize;
+    changedTiles.tilesPerSide = (DefaultGrid::width + tileSize - 1) / tileSize;
+    changedTiles.changed.assign(changedTiles.tilesPerSide * changedTiles.tilesPerSide, 0);
+    changedTiles.numChanged = 0;
+    for(int y = 0; y < DefaultGrid::height; y++){
+        for(int x = 0; x < DefaultGrid::width; x++){
+            int idx = getIndex(x, y);
+            if(dataPre[idx] != dataPost[idx]){
+                int t = (x / tileSize) + (y / tileSize) * changedTiles.tilesPerSide;
+                changedTiles.numChanged += (changedTiles.changed[t] == 0);
+                changedTiles.changed[t] = 1;
+            }
+        }
+    }
+    return changedTiles;
+}
+
+//Could the kernel height at p differ between the maps? Only pixels whose center is within rp of p have weight,
+//so check the tiles under that footprint
+bool stencilTouchesChange(const Eigen::Vector3d& p, double rp, const ChangedTileIndex& changedTiles){
+    if(changedTiles.numChanged == 0){
+        return false;
+    }
+    int rLo = max(0, (int)ceil((p[0] - rp - DefaultGrid::halfCell) / DefaultGrid::cellSize));
+    int rHi = min(DefaultGrid::width - 1, (int)floor((p[0] + rp - DefaultGrid::halfCell) / DefaultGrid::cellSize));
+    int sLo = max(0, (int)ceil((p[1] - rp - DefaultGrid::halfCell) / DefaultGrid::cellSize));
+    int sHi = min(DefaultGrid::height - 1, (int)floor((p[1] + rp - DefaultGrid::halfCell) / DefaultGrid::cellSize));
+    if(rLo > rHi || sLo > sHi){
+        return false;
+    }
+    for(int ty = sLo / changedTiles.tileSize; ty <= sHi / changedTiles.tileSize; ty++){
+        for(int tx = rLo / changedTiles.tileSize; tx <= rHi / changedTiles.tileSize; tx++){
+            if(changedTiles.changed[tx + ty * changedTiles.tilesPerSide]){
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//Add a map to the store and return its epoch number. The first map becomes the base, later ones only keep the tiles that differ from it
+int addEpoch(EpochStore& store, const vector<unsigned char>& data){
+    const int tileBytes = EPOCH_TILE * EPOCH_TILE;
+    if(store.base.empty()){
+        store.base = data;
+    }
+    const vector<int>* previousSlots = store.tileSlots.empty() ? nullptr : &store.tileSlots.back();
+
+    vector<int> slots(EPOCH_TILES_PER_SIDE * EPOCH_TILES_PER_SIDE, -1);
+    vector<unsigned char> tile(tileBytes);
+    for(int ty = 0; ty < EPOCH_TILES_PER_SIDE; ty++){
+        for(int tx = 0; tx < EPOCH_TILES_PER_SIDE; tx++){
+            bool differsFromBase = false;
+            for(int v = 0; v < EPOCH_TILE; v++){
+                for(int u = 0; u < EPOCH_TILE; u++){
+                    int idx = getIndex(tx * EPOCH_TILE + u, ty * EPOCH_TILE + v);
+                    tile[u + v * EPOCH_TILE] = data[idx];
+                    differsFromBase |= (data[idx] != store.base[idx]);
+                }
+            }
+            if(!differsFromBase){
+                continue;
+            }
+
+            int t = tx + ty * EPOCH_TILES_PER_SIDE;
+            int previousSlot = previousSlots ? (*previousSlots)[t] : -1;
+            if(previousSlot >= 0 && equal(tile.begin(), tile.end(), store.tilePool.begin() + (size_t)previousSlot * tileBytes)){
+                slots[t] = previousSlot; //same change as last epoch, share it
+            }
+            else{
+                slots[t] = (int)(store.tilePool.size() / tileBytes);
+                store.tilePool.insert(store.tilePool.end(), tile.begin(), tile.end());
+            }
+        }
+    }
+    store.tileSlots.push_back(slots);
+    return (int)store.tileSlots.size() - 1;
+}
+
+EpochView getEpoch(const EpochStore& store, int epoch){
+    EpochView view;
+    view.store = &store;
+    view.slots = store.tileSlots[epoch].data();
+    return view;
+}
+
+//Bytes held by the store: base map, every tile table and the tile pool
+size_t epochStoreBytes(const EpochStore& store){
+    size_t bytes = store.base.size() + store.tilePool.size();
+    for(const vector<int>& slots : store.tileSlots){
+        bytes += slots.size() * sizeof(int);
+    }
+    return bytes;
+}
+
+//Read a raw map of numPixels bytes (512x512 unless told otherwise)
+bool readRaster(const string& fileName, vector<unsigned char>& data, int numPixels){
+    ifstream file(fileName, ios::binary);
+    if(!file.is_open()){
+        return false;
+    }
+    data.resize(numPixels);
+    file.read(reinterpret_cast<char*>(data.data()), data.size());
+    //a file of any other size is a map of some other shape, reading its first numPixels bytes would give the wrong pixels
+    return file.gcount() == (streamsize)data.size() && file.peek() == ifstream::traits_type::eof();
+}
+
+//Kernel heights at every pixel center, then a running sum of segment lengths down each row, column and diagonal
+LinePrefixIndex buildLinePrefixIndex(MapView data){
+    const int W = DefaultGrid::width;
+    const int H = DefaultGrid::height;
+    double rp = DefaultGrid::cellSize * sqrt(2);
+
+    LinePrefixIndex index;
+    index.kernelHeights.assign(DefaultGrid::numPixels, 0.0);
+    for(int y = 0; y < H; y++){
+        for(int x = 0; x < W; x++){
+            Eigen::Vector3d p(DefaultGrid::center(x), DefaultGrid::center(y), 0.0);
+            computeHeight(p, rp, data);
+            index.kernelHeights[getIndex(x, y)] = p[2];
+        }
+    }
+
+    //length of the step into (x,y) from (x-dx,y-dy), or 0 if that pixel is off the map (start of the line)
+    auto stepLength = [&](int x, int y, int dx, int dy){
+        int px = x - dx;
+        int py = y - dy;
+        if(px < 0 || py < 0 || px >= W || py >= H){
+            return 0.0;
+        }
+        double planar2 = DefaultGrid::cellSize * DefaultGrid::cellSize * (double)(dx * dx + dy * dy);
+        double rise = index.kernelHeights[getIndex(x, y)] - index.kernelHeights[getIndex(px, py)];
+        return sqrt(planar2 + rise * rise);
+    };
+
+    index.rows.assign(DefaultGrid::numPixels, 0.0);
+    index.columns.assign(DefaultGrid::numPixels, 0.0);
+    index.diagonals.assign(DefaultGrid::numPixels, 0.0);
+    index.antiDiagonals.assign(DefaultGrid::numPixels, 0.0);
+    for(int y = 0; y < H; y++){
+        for(int x = 0; x < W; x++){
+            int idx = getIndex(x, y);
+            index.rows[idx] = (x > 0 ? index.rows[getIndex(x - 1, y)] : 0.0) + stepLength(x, y, 1, 0);
+            index.columns[idx] = (y > 0 ? index.columns[getIndex(x, y - 1)] : 0.0) + stepLength(x, y, 0, 1);
+            index.diagonals[idx] = (x > 0 && y > 0 ? index.diagonals[getIndex(x - 1, y - 1)] : 0.0) + stepLength(x, y, 1, 1);
+        }
+    }
+    //the anti-diagonals run towards -y so fill them from the top row down
+    for(int y = H - 1; y >= 0; y--){
+        for(int x = 0; x < W; x++){
+            index.antiDiagonals[getIndex(x, y)] = (x > 0 && y < H - 1 ? index.antiDiagonals[getIndex(x - 1, y + 1)] : 0.0) + stepLength(x, y, 1, -1);
+        }
+    }
+    return index;
+}
+
+//Surface distance between two pixels on the same row, column or 45 degree diagonal, in constant time
+//Kernel samples at the pixel centers in between, real pixel heights at A and B (same as the engine does at the ends)
+//Returns false (and leaves distance alone) if A and B aren't on an indexed line
+bool lookupLineDistance(int x1, int y1, int x2, int y2, const LinePrefixView& index, MapView data, double& distance){
+    int dx = x2 - x1;
+    int dy = y2 - y1;
+    const double* prefix;
+    if(index.kernelHeights == nullptr){
+        return false; //no tables built
+    }
+    if(dy == 0){
+        prefix = index.rows;
+    }
+    else if(dx == 0){
+        prefix = index.columns;
+    }
+    else if(dx == dy){
+        prefix = index.diagonals;
+    }
+    else if(dx == -dy){
+        prefix = index.antiDiagonals;
+    }
+    else{
+        return false;
+    }
+
+    //walk the way the table was summed (+x, or +y for columns) so B comes after A
+    if(dx < 0 || (dx == 0 && dy < 0)){
+        swap(x1, x2);
+        swap(y1, y2);
+        dx = -dx;
+        dy = -dy;
+    }
+    int steps = max(abs(dx), abs(dy));
+    int ux = (dx > 0) - (dx < 0);
+    int uy = (dy > 0) - (dy < 0);
+
+    double heightA = (double)data[getIndex(x1, y1)] * DefaultGrid::verticalScale;
+    double heightB = (double)data[getIndex(x2, y2)] * DefaultGrid::verticalScale;
+    double planar2 = DefaultGrid::cellSize * DefaultGrid::cellSize * (double)(ux * ux + uy * uy);
+    if(steps <= 1){
+        distance = sqrt((double)steps * planar2 + (heightB - heightA) * (heightB - heightA));
+        return true;
+    }
+
+    int first = getIndex(x1 + ux, y1 + uy); //first and last kernel samples
+    int last = getIndex(x2 - ux, y2 - uy);
+    double riseA = index.kernelHeights[first] - heightA;
+    double riseB = heightB - index.kernelHeights[last];
+    distance = sqrt(planar2 + riseA * riseA) + (prefix[last] - prefix[first]) + sqrt(planar2 + riseB * riseB);
+    return true;
+}
+
+//Prefix tables when A and B share a row, column or diagonal, the sliding window walker for every other angle
+double computeSurfaceDistanceIndexed(int x1, int y1, int x2, int y2, const LinePrefixView& index, MapView data){
+    double distance;
+    if(lookupLineDistance(x1, y1, x2, y2, index, data, distance)){
+        TERRAIN_STAT(countStat(STAT_QUERIES, 1);)
+        return distance;
+    }
+    return walkSurfaceDistance(x1, y1, x2, y2, DefaultGrid::cellSize * sqrt(2), data);
+}
+
+int getIndex(int x, int y){
+    return DefaultGrid::index(x, y);
+}
+
+//Runtime grid descriptor for a width x height map
+bool makeRuntimeGrid(int64_t width, int64_t height, double cellSize, double verticalScale, RuntimeGrid& grid){
+    //pixels are indexed with int, so the whole map has to fit in one
+    if(width <= 0 || height <= 0 || width > INT32_MAX || height > INT32_MAX || width * height > (int64_t)INT32_MAX || !(cellSize > 0.0) || !isfinite(cellSize) || !(verticalScale > 0.0) || !isfinite(verticalScale)){
+        return false;
+    }
+    grid.width = (int)width;
+    grid.height = (int)height;
+    grid.numPixels = (int)(width * height);
+    grid.cellSize = cellSize;
+    grid.halfCell = 0.5 * cellSize;
+    grid.verticalScale = verticalScale;
+    return true;
+}
+
+//Pad the map with halo ghost cells on every side, filled according to the policy
+HaloRaster buildHaloRaster(MapView data, int halo, HaloFill fill){
+    //computeHeight reads 2 cells past the sample's cell with no bounds check, and a mirror or clamp source more than
+    //width - 1 cells out would itself be off the map
+    halo = max(2, min(halo, DefaultGrid::width - 1));
+    HaloRaster raster;
+    raster.halo = halo;
+    raster.stride = DefaultGrid::width + 2 * halo;
+    raster.fill = fill;
+    raster.values.assign((size_t)raster.stride * raster.stride, 0.0f);
+    raster.weights.assign((size_t)raster.stride * raster.stride, 1.0f);
+
+    //map a padded coordinate back onto the map, -1 means no source pixel
+    auto source = [&](int c){
+        if(c >= 0 && c < DefaultGrid::width){
+            return c;
+        }
+        switch(fill){
+            case HALO_CLAMP:
+                return c < 0 ? 0 : DefaultGrid::width - 1;
+            case HALO_MIRROR:
+                return c < 0 ? -c : 2 * (DefaultGrid::width - 1) - c;
+            case HALO_TOROIDAL:
+                return ((c % DefaultGrid::width) + DefaultGrid::width) % DefaultGrid::width;
+            default:
+                return -1;
+        }
+    };
+
+    for(int y = -halo; y < DefaultGrid::height + halo; y++){
+        for(int x = -halo; x < DefaultGrid::width + halo; x++){
+            int paddedIdx = (x + halo) + (y + halo) * raster.stride;
+            int sx = source(x);
+            int sy = source(y);
+            if(sx < 0 || sy < 0){
+                raster.weights[paddedIdx] = 0.0f;
+                continue;
+            }
+            raster.values[paddedIdx] = (float)data[getIndex(sx, sy)];
+        }
+    }
+    return raster;
+}
+
+//computeHeight on a halo padded map: same stencil and weights, but no bounds checks since every stencil cell exists
+//(ghost cells just carry whatever the fill policy put there). The planar offsets are separable so they get computed per row
+//and per column once, and the inner loop walks along x so it reads memory contiguously
+void computeHeight(Eigen::Vector3d& p, double rp, const HaloRaster& data, const DefaultGrid& grid){
+    int i = (int)floor(p[0]/grid.cellSize);
+    int j = (int)floor(p[1]/grid.cellSize);
+
+    double dx2[5];
+    double dy2[4];
+    for(int a = 0; a < 5; a++){
+        double dx = p[0] - (grid.center(i - 2 + a));
+        dx2[a] = dx * dx;
+    }
+    for(int b = 0; b < 4; b++){
+        double dy = p[1] - (grid.center(j - 2 + b));
+        dy2[b] = dy * dy;
+    }
+
+    double invRp = 1.0 / rp;
+    double Hx = 0;
+    double Sx = 0;
+    const float* values = data.values.data() + (i - 2 + data.halo) + (size_t)(j - 2 + data.halo) * data.stride;
+    const float* weights = data.weights.data() + (i - 2 + data.halo) + (size_t)(j - 2 + data.halo) * data.stride;
+    for(int b = 0; b < 4; b++){
+        for(int a = 0; a < 5; a++){
+            double rBar = sqrt(dx2[a] + dy2[b]) * invRp;
+            double omega = (rBar < 1.0) ? (1 - (3 * rBar * rBar) + (2 * rBar * rBar * rBar)) : 0.0;
+            omega *= (double)weights[a];
+            Hx += (double)values[a] * grid.verticalScale * omega;
+            Sx += omega;
+        }
+        values += data.stride;
+        weights += data.stride;
+    }
+    if(Sx > 0){
+        p[2] = Hx / Sx;
+    }
+}
+
+// Same field as computeHeight, but also accumulates grad H and grad S in the same stencil pass so we get the local slope for free
+// h = H/S  -->  grad h = (grad H - h * grad S) / S
+// omega(rBar) = 1 - 3rBar^2 + 2rBar^3  -->  grad omega = 6(rBar - 1)/rp^2 * (p - x_pixel), no divide by the distance so p sitting on a pixel center is fine
+// grad is dh/dx, dh/dy in meters per meter, left at zero if no pixel is in range
+void computeHeightAndGradient(Eigen::Vector3d& p, Eigen::Vector2d& grad, double rp, MapView data){
+    vector<int> idx;
+    idx = PointToGridIndeces(p);
+    int i = idx[0];
+    int j = idx[1];
+    double Hx = 0; //field num, H(x)
+    double Sx = 0; //field denom, S(x)
+    Eigen::Vector2d gradH(0.0, 0.0);
+    Eigen::Vector2d gradS(0.0, 0.0);
+    double gradScale = 6.0 / (rp * rp);
+    for(int r = i-2; r < i+3; r++){ //same 5x5 stencil as computeHeight
+        for(int s = j-2; s < j+2; s++){
+
+            if(r >= DefaultGrid::width || s >= DefaultGrid::height || r < 0 || s < 0){
+                continue;
+            }
+
+            Eigen::Vector2d delta(p[0] - (DefaultGrid::center(r)), p[1] - (DefaultGrid::center(s)));
+            double rBar = delta.norm() / rp;
+            if(rBar > 1.0){
+                continue; //zero weight and zero gradient outside the kernel
+            }
+            double omega = 1 - (3 * rBar * rBar) + (2 * rBar * rBar * rBar);
+            Eigen::Vector2d gradOmega = (gradScale * (rBar - 1.0)) * delta;
+            double pixelHeight = (double)data[getIndex(r, s)] * DefaultGrid::verticalScale;
+
+            Hx += pixelHeight * omega;
+            Sx += omega;
+            gradH += pixelHeight * gradOmega;
+            gradS += gradOmega;
+        }
+    }
+    grad.setZero();
+    if(Sx > 0){
+        p[2] = Hx / Sx;
+        grad = (gradH - p[2] * gradS) / Sx;
+    }
+
+    return;
+}
+
+// Kernel field for several radii at once. Each stencil pixel is loaded and its distance computed once,
+// then the weights for every radius are evaluated together as one Eigen array op (one SIMD lane per radius)
+// The stencil is sized from rMax instead of the fixed 5x5 so large radii still see all their neighbors
+// heights[k] is the height for radius 1/invRadii[k], the caller's heights[k] is left unchanged if no pixel is in range for that radius
+void computeHeightMultiRadius(const Eigen::Vector3d& p, const Eigen::ArrayXd& invRadii, double rMax, MapView data, Eigen::ArrayXd& heights){
+    int numRadii = (int)invRadii.size();
+    Eigen::ArrayXd Hx = Eigen::ArrayXd::Zero(numRadii);
+    Eigen::ArrayXd Sx = Eigen::ArrayXd::Zero(numRadii);
+    Eigen::ArrayXd rBar(numRadii);
+    Eigen::ArrayXd omega(numRadii);
+
+    //only pixels whose center is within rMax of p can have weight
+    int rLo = max(0, (int)ceil((p[0] - rMax - DefaultGrid::halfCell) / DefaultGrid::cellSize));
+    int rHi = min(DefaultGrid::width - 1, (int)floor((p[0] + rMax - DefaultGrid::halfCell) / DefaultGrid::cellSize));
+    int sLo = max(0, (int)ceil((p[1] - rMax - DefaultGrid::halfCell) / DefaultGrid::cellSize));
+    int sHi = min(DefaultGrid::height - 1, (int)floor((p[1] + rMax - DefaultGrid::halfCell) / DefaultGrid::cellSize));
+    for(int r = rLo; r <= rHi; r++){
+        for(int s = sLo; s <= sHi; s++){
+            Eigen::Vector2d pixelPos(DefaultGrid::center(r), DefaultGrid::center(s));
+            double dist = (p.head<2>() - pixelPos).norm();
+            if(dist > rMax){
+                continue;
+            }
+            double pixelHeight = (double)data[getIndex(r, s)] * DefaultGrid::verticalScale;
+
+            rBar = dist * invRadii;
+            omega = (rBar > 1.0).select(0.0, 1.0 - 3.0 * rBar.square() + 2.0 * rBar.cube());
+            Hx += pixelHeight * omega;
+            Sx += omega;
+        }
+    }
+    heights = (Sx > 0.0).select(Hx / Sx, heights);
+}
+
+// Kernel field on the pre and post maps at the same point. The weights only depend on where the pixels are,
+// so they are computed once and applied to both maps in the same stencil pass
+// heights are only written if some pixel is in range, same as computeHeight
+void computeHeightBothEpochs(const Eigen::Vector3d& p, double rp, MapView dataPre, MapView dataPost, double& heightPre, double& heightPost){
+    int i = (int)floor(p[0]/DefaultGrid::cellSize);
+    int j = (int)floor(p[1]/DefaultGrid::cellSize);
+    double HxPre = 0;
+    double HxPost = 0;
+    double Sx = 0;
+    TERRAIN_STAT(uint64_t offMap = 0; uint64_t outOfRange = 0;)
+    for(int r = i-2; r < i+3; r++){ //same stencil as computeHeight
+        for(int s = j-2; s < j+2; s++){
+            if(r >= DefaultGrid::width || s >= DefaultGrid::height || r < 0 || s < 0){
+                TERRAIN_STAT(offMap++;)
+                continue;
+            }
+
+            Eigen::Vector2d pixelPos(DefaultGrid::center(r), DefaultGrid::center(s));
+            double rBar = (p.head<2>() - pixelPos).norm() / rp;
+            if(rBar > 1.0){
+                TERRAIN_STAT(outOfRange++;)
+                continue;
+            }
+            double omega = 1 - (3 * rBar * rBar) + (2 * rBar * rBar * rBar);
+            int pixelIdx = getIndex(r, s);
+
+            HxPre += (double)dataPre[pixelIdx] * DefaultGrid::verticalScale * omega;
+            HxPost += (double)dataPost[pixelIdx] * DefaultGrid::verticalScale * omega;
+            Sx += omega;
+        }
+    }
+    if(Sx > 0){
+        heightPre = HxPre / Sx;
+        heightPost = HxPost / Sx;
+    }
+    //counted as one sample on each map, only the pixels in range are read
+    TERRAIN_STAT(
+        countStat(STAT_SAMPLES, 2);
+        countStat(STAT_STENCIL_VISITED, 40);
+        countStat(STAT_STENCIL_ZERO_WEIGHT, 2 * (offMap + outOfRange));
+        countStat(STAT_BYTES_READ, 2 * (20 - offMap - outOfRange));
+    )
+}
+
+//What pixel coordinate does this particle lie in?
+vector<int> PointToGridIndeces(Eigen::Vector3d p){
+    vector<int> idx(2,-1);
+    int i, j = 0;
+    i = floor(p[0]/DefaultGrid::cellSize);
+    j = floor(p[1]/DefaultGrid::cellSize);
+    idx[0] = i;
+    idx[1] = j;
+    return idx;
+}
+
+//Per-thread counter blocks. A thread's block is made on its first count and folded into retiredStats when the thread exits
+thread_local ThreadStatsBlock* threadStatsBlock = nullptr;
+static mutex statsMutex;
+static vector<ThreadStatsBlock*> liveStatsBlocks;
+static QueryStats retiredStats = {};
+
+namespace {
+struct ThreadStatsOwner{
+    ~ThreadStatsOwner(){
+        if(!threadStatsBlock){
+            return;
+        }
+        lock_guard<mutex> lock(statsMutex);
+        for(int k = 0; k < NUM_QUERY_STATS; k++){
+            retiredStats.counts[k] += threadStatsBlock->counts[k].load(memory_order_relaxed);
+        }
+        liveStatsBlocks.erase(find(liveStatsBlocks.begin(), liveStatsBlocks.end(), threadStatsBlock));
+        delete threadStatsBlock;
+        threadStatsBlock = nullptr;
+    }
+};
+thread_local ThreadStatsOwner threadStatsOwner;
+}
+
+ThreadStatsBlock* registerThreadStats(){
+    ThreadStatsBlock* block = new ThreadStatsBlock();
+    for(int k = 0; k < NUM_QUERY_STATS; k++){
+        block->counts[k].store(0, memory_order_relaxed);
+    }
+    (void)&threadStatsOwner; //odr-use, so the owner is constructed on this thread and cleans up at exit
+    {
+        lock_guard<mutex> lock(statsMutex);
+        liveStatsBlocks.push_back(block);
+    }
+    threadStatsBlock = block;
+    return block;
+}
+
+QueryStats threadQueryStats(){
+    QueryStats stats = {};
+    if(threadStatsBlock){
+        for(int k = 0; k < NUM_QUERY_STATS; k++){
+            stats.counts[k] = threadStatsBlock->counts[k].load(memory_order_relaxed);
+        }
+    }
+    return stats;
+}
+
+QueryStats processQueryStats(){
+    lock_guard<mutex> lock(statsMutex);
+    QueryStats stats = retiredStats;
+    for(ThreadStatsBlock* block : liveStatsBlocks){
+        for(int k = 0; k < NUM_QUERY_STATS; k++){
+            stats.counts[k] += block->counts[k].load(memory_order_relaxed);
+        }
+    }
+    return stats;
+}
+
+QueryStats takeThreadQueryStats(){
+    QueryStats stats = threadQueryStats();
+    if(threadStatsBlock){
+        for(int k = 0; k < NUM_QUERY_STATS; k++){
+            threadStatsBlock->counts[k].store(0, memory_order_relaxed);
+        }
+    }
+    return stats;
+}
+
+void addThreadQueryStats(const QueryStats& stats){
+    for(int k = 0; k < NUM_QUERY_STATS; k++){
+        if(stats.counts[k] != 0){
+            countStat((QueryStat)k, stats.counts[k]);
+        }
+    }
+}
+
+QueryStats subtractQueryStats(const QueryStats& after, const QueryStats& before){
+    QueryStats stats;
+    for(int k = 0; k < NUM_QUERY_STATS; k++){
+        stats.counts[k] = after.counts[k] - before.counts[k];
+    }
+    return stats;
+}
+
+const char* queryStatName(QueryStat stat){
+    static const char* names[NUM_QUERY_STATS] = {"queries", "samples", "stencil_visited", "stencil_zero_weight", "cache_hits", "cache_misses", "tiles_faulted", "bytes_read"};
+    return names[stat];
+}
+
+string queryStatsJson(const QueryStats& stats){
+    string json = string("{\"enabled\":") + (QUERY_STATS_ENABLED ? "true" : "false");
+    for(int k = 0; k < NUM_QUERY_STATS; k++){
+        json += string(",\"") + queryStatName((QueryStat)k) + "\":" + to_string(stats.counts[k]);
+    }
+    return json + "}";
+}
+
+TerrainDistanceEngine::TerrainDistanceEngine(bool buildLineIndexes) : lineIndexes(buildLineIndexes){
+    for(int k = 0; k < NUM_QUERY_STATS; k++){
+        statTotals[k].store(0, memory_order_relaxed);
+    }
+}
+
+static thread_local int statsScopeDepth = 0;
+
+TerrainDistanceEngine::StatsScope::StatsScope(const TerrainDistanceEngine& e) : engine(e), outermost(statsScopeDepth++ == 0){
+    if(outermost){
+        before = threadQueryStats();
+    }
+}
+
+TerrainDistanceEngine::StatsScope::~StatsScope(){
+    statsScopeDepth--;
+    if(!outermost){
+        return; //the outer scope gets it
+    }
+    QueryStats spent = subtractQueryStats(threadQueryStats(), before);
+    for(int k = 0; k < NUM_QUERY_STATS; k++){
+        if(spent.counts[k] != 0){
+            engine.statTotals[k].fetch_add(spent.counts[k], memory_order_relaxed);
+        }
+    }
+}
+
+QueryStats TerrainDistanceEngine::stats() const{
+    QueryStats stats;
+    for(int k = 0; k < NUM_QUERY_STATS; k++){
+        stats.counts[k] = statTotals[k].load(memory_order_relaxed);
+    }
+    return stats;
+}
+
+TerrainDistanceEngine::~TerrainDistanceEngine(){
+    for(const pair<void*, size_t>& mapping : mappings){
+        munmap(mapping.first, mapping.second);
+    }
+}
+
+//Read a map from disk and add it as the next epoch
+int TerrainDistanceEngine::loadEpoch(const string& fileName){
+    vector<unsigned char> data;
+    if(!readRaster(fileName, data)){
+        return -1;
+    }
+    return addEpoch(data);
+}
+
+//Add a map as the next epoch and build its indexes, this is where all the precompute cost is paid
+int TerrainDistanceEngine::addEpoch(const vector<unsigned char>& data){
+    unique_ptr<Epoch> epoch(new Epoch());
+    epoch->data = data;
+    epoch->heightRanges = buildHeightRangeTiles(epoch->data, 16);
+    epoch->pixels = MapView(epoch->data);
+    epoch->heightRangeView = HeightRangeView(epoch->heightRanges);
+    if(lineIndexes){
+        epoch->lineIndex = buildLinePrefixIndex(epoch->data);
+        epoch->lineView = LinePrefixView(epoch->lineIndex);
+    }
+    epochs.push_back(move(epoch));
+    return (int)epochs.size() - 1;
+}
+
+//Where each part of epoch block sits, see SharedDatasetHeader
+static uint64_t sharedAlign(uint64_t bytes){
+    return (bytes + SHARED_DATASET_ALIGN - 1) / SHARED_DATASET_ALIGN * SHARED_DATASET_ALIGN;
+}
+static uint64_t sharedPixelsOffset(bool lineTables){
+    return lineTables ? 5 * (uint64_t)DefaultGrid::numPixels * sizeof(double) : 0;
+}
+static uint64_t sharedTilesOffset(bool lineTables){
+    return sharedPixelsOffset(lineTables) + (uint64_t)DefaultGrid::numPixels;
+}
+
+//Build the whole segment in a fresh shared memory object, then flip the magic so attachers can see it
+//Whatever was published under name before is unlinked first, processes still attached to it keep their copy
+//Line tables go in only if every epoch has them, an attached segment published without them has none to copy
+bool TerrainDistanceEngine::publishShared(const string& name) const{
+    int tilesPerSide = epochs.empty() ? 0 : epochs[0]->heightRangeView.tilesPerSide;
+    uint64_t numTiles = (uint64_t)tilesPerSide * tilesPerSide;
+    bool lineTables = !epochs.empty();
+    for(const unique_ptr<Epoch>& epoch : epochs){
+        lineTables = lineTables && epoch->lineView.rows != nullptr;
+    }
+    uint64_t epochBytes = sharedAlign(sharedTilesOffset(lineTables) + 2 * numTiles);
+    uint64_t firstEpoch = sharedAlign(sizeof(SharedDatasetHeader));
+    uint64_t totalBytes = firstEpoch + epochBytes * epochs.size();
+
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0){
+        return false;
+    }
+    if(ftruncate(fd, (off_t)totalBytes) < 0){
+        close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    void* base = mmap(nullptr, totalBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED){
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    char* bytes = static_cast<char*>(base);
+    for(size_t e = 0; e < epochs.size(); e++){
+        const Epoch& epoch = *epochs[e];
+        char* block = bytes + firstEpoch + epochBytes * e;
+        if(lineTables){
+            const double* tables[5] = {epoch.lineView.kernelHeights, epoch.lineView.rows, epoch.lineView.columns, epoch.lineView.diagonals, epoch.lineView.antiDiagonals};
+            for(int t = 0; t < 5; t++){
+                memcpy(block + (uint64_t)t * DefaultGrid::numPixels * sizeof(double), tables[t], DefaultGrid::numPixels * sizeof(double));
+            }
+        }
+        memcpy(block + sharedPixelsOffset(lineTables), epoch.pixels.pixels, DefaultGrid::numPixels);
+        memcpy(block + sharedTilesOffset(lineTables), epoch.heightRangeView.minValue, numTiles);
+        memcpy(block + sharedTilesOffset(lineTables) + numTiles, epoch.heightRangeView.maxValue, numTiles);
+    }
+
+    SharedDatasetHeader* header = reinterpret_cast<SharedDatasetHeader*>(base);
+    header->version = SHARED_DATASET_VERSION;
+    header->headerBytes = sizeof(SharedDatasetHeader);
+    header->width = DefaultGrid::width;
+    header->height = DefaultGrid::height;
+    header->numEpochs = (uint32_t)epochs.size();
+    header->heightTileSize = epochs.empty() ? 0 : (uint32_t)epochs[0]->heightRangeView.tileSize;
+    header->heightTilesPerSide = (uint32_t)tilesPerSide;
+    header->lineTables = lineTables ? 1 : 0;
+    header->reserved = 0;
+    header->epochBytes = epochBytes;
+    header->totalBytes = totalBytes;
+    __atomic_store_n(&header->magic, SHARED_DATASET_MAGIC, __ATOMIC_RELEASE);
+    munmap(base, totalBytes);
+    return true;
+}
+
+//Map a published segment read-only and add its epochs, they are queried right where they sit
+bool TerrainDistanceEngine::attachShared(const string& name){
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if(fd < 0){
+        return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info) < 0 || (uint64_t)info.st_size < sizeof(SharedDatasetHeader)){
+        close(fd);
+        return false;
+    }
+    size_t mappedBytes = (size_t)info.st_size;
+    void* base = mmap(nullptr, mappedBytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED){
+        return false;
+    }
+
+    //anything that doesn't match exactly what this build would have written gets refused
+    const SharedDatasetHeader* header = static_cast<const SharedDatasetHeader*>(base);
+    uint64_t numTiles = (uint64_t)header->heightTilesPerSide * header->heightTilesPerSide;
+    uint64_t firstEpoch = sharedAlign(sizeof(SharedDatasetHeader));
+    if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHARED_DATASET_MAGIC || header->version != SHARED_DATASET_VERSION
+       || header->headerBytes != sizeof(SharedDatasetHeader) || header->width != (uint32_t)DefaultGrid::width || header->height != (uint32_t)DefaultGrid::height
+       || header->heightTileSize == 0 || header->heightTilesPerSide != (DefaultGrid::width + header->heightTileSize - 1) / header->heightTileSize
+       || header->lineTables > 1 || header->epochBytes != sharedAlign(sharedTilesOffset(header->lineTables == 1) + 2 * numTiles)
+       || header->totalBytes != firstEpoch + header->epochBytes * header->numEpochs || header->totalBytes > mappedBytes){
+        munmap(base, mappedBytes);
+        return false;
+    }
+
+    const char* bytes = static_cast<const char*>(base);
+    bool lineTables = (header->lineTables == 1);
+    for(uint32_t e = 0; e < header->numEpochs; e++){
+        const char* block = bytes + firstEpoch + header->epochBytes * e;
+        const double* tables = reinterpret_cast<const double*>(block);
+        unique_ptr<Epoch> epoch(new Epoch());
+        epoch->pixels = MapView(reinterpret_cast<const unsigned char*>(block + sharedPixelsOffset(lineTables)));
+        epoch->heightRangeView.tileSize = (int)header->heightTileSize;
+        epoch->heightRangeView.tilesPerSide = (int)header->heightTilesPerSide;
+        epoch->heightRangeView.minValue = reinterpret_cast<const unsigned char*>(block + sharedTilesOffset(lineTables));
+        epoch->heightRangeView.maxValue = reinterpret_cast<const unsigned char*>(block + sharedTilesOffset(lineTables) + numTiles);
+        if(lineTables){ //otherwise the view stays null and indexed queries walk
+            epoch->lineView.kernelHeights = tables;
+            epoch->lineView.rows = tables + DefaultGrid::numPixels;
+            epoch->lineView.columns = tables + 2 * DefaultGrid::numPixels;
+            epoch->lineView.diagonals = tables + 3 * DefaultGrid::numPixels;
+            epoch->lineView.antiDiagonals = tables + 4 * DefaultGrid::numPixels;
+        }
+        epochs.push_back(move(epoch));
+    }
+    mappings.push_back(make_pair(base, mappedBytes));
+    return true;
+}
+
+bool removeShared(const string& name){
+    return shm_unlink(name.c_str()) == 0;
+}
+
+int TerrainDistanceEngine::numEpochs() const{
+    return (int)epochs.size();
+}
+
+MapView TerrainDistanceEngine::epochData(int epoch) const{
+    return epochs[epoch]->pixels;
+}
+
+size_t TerrainDistanceEngine::residentBytes() const{
+    size_t bytes = 0;
+    for(const unique_ptr<Epoch>& epoch : epochs){
+        bytes += epoch->data.capacity();
+        bytes += epoch->heightRanges.minValue.capacity() + epoch->heightRanges.maxValue.capacity();
+        bytes += (epoch->lineIndex.kernelHeights.capacity() + epoch->lineIndex.rows.capacity() + epoch->lineIndex.columns.capacity()
+                  + epoch->lineIndex.diagonals.capacity() + epoch->lineIndex.antiDiagonals.capacity()) * sizeof(double);
+    }
+    for(const pair<void*, size_t>& mapping : mappings){
+        bytes += mapping.second;
+    }
+    return bytes;
+}
+
+//Distance on one epoch, same answer as computeSurfaceDistance
+double TerrainDistanceEngine::surfaceDistance(int epoch, const SurfaceQuery& q) const{
+    TERRAIN_STAT(StatsScope scope(*this);)
+    return walkSurfaceDistance(q.x1, q.y1, q.x2, q.y2, DefaultGrid::cellSize * sqrt(2), epochs[epoch]->pixels);
+}
+
+//Constant time for straight rows/columns/diagonals (sampled at every pixel center, so rows and columns come out a bit denser
+//than surfaceDistance), anything else is walked
+double TerrainDistanceEngine::surfaceDistanceIndexed(int epoch, const SurfaceQuery& q) const{
+    TERRAIN_STAT(StatsScope scope(*this);)
+    return computeSurfaceDistanceIndexed(q.x1, q.y1, q.x2, q.y2, epochs[epoch]->lineView, epochs[epoch]->pixels);
+}
+
+//Same query on two epochs, the kernel weights are shared between them
+void TerrainDistanceEngine::surfaceDistancePair(int epochA, int epochB, const SurfaceQuery& q, double& distanceA, double& distanceB) const{
+    TERRAIN_STAT(StatsScope scope(*this);)
+    computeSurfaceDistancePair(q.x1, q.y1, q.x2, q.y2, DefaultGrid::cellSize * sqrt(2), epochs[epochA]->pixels, epochs[epochB]->pixels, distanceA, distanceB);
+}
+
+vector<double> TerrainDistanceEngine::surfaceDistanceMultiRadius(int epoch, const SurfaceQuery& q, const vector<double>& radii) const{
+    TERRAIN_STAT(StatsScope scope(*this);)
+    return computeSurfaceDistanceMultiRadius(q.x1, q.y1, q.x2, q.y2, radii, epochs[epoch]->pixels);
+}
+
+bool TerrainDistanceEngine::surfaceDistanceBelow(int epoch, const SurfaceQuery& q, double limit) const{
+    TERRAIN_STAT(StatsScope scope(*this);)
+    return ::surfaceDistanceBelow(q.x1, q.y1, q.x2, q.y2, limit, epochs[epoch]->pixels, epochs[epoch]->heightRangeView);
+}
+
+void TerrainDistanceEngine::surfaceDistanceBatch(int epochA, int epochB, const vector<SurfaceQuery>& queries, vector<double>& distancesA, vector<double>& distancesB, int numThreads) const{
+    TERRAIN_STAT(StatsScope scope(*this);)
+    computeSurfaceDistanceBatch(queries, epochs[epochA]->pixels, epochs[epochB]->pixels, distancesA, distancesB, numThreads);
+}
+
+void TerrainDistanceEngine::surfaceDistanceMap(int epochA, int epochB, int x0, int y0, vector<float>& mapA, vector<float>& mapB, vector<float>& mapDiff, int numThreads) const{
+    TERRAIN_STAT(StatsScope scope(*this);)
+    computeSurfaceDistanceMap(x0, y0, epochs[epochA]->pixels, epochs[epochB]->pixels, mapA, mapB, mapDiff, numThreads);
+}
+
+LiveEngine::LiveEngine() : current(nullptr), activeSlot(0){
+    readers[0] = 0;
+    readers[1] = 0;
+}
+
+LiveEngine::~LiveEngine(){
+    delete current.load();
+}
+
+//Count ourselves in the active slot BEFORE loading the version, see publish for why that's enough
+LiveEngine::Reader::Reader(const LiveEngine& liveEngine) : live(&liveEngine){
+    slot = live->activeSlot.load();
+    live->readers[slot].fetch_add(1);
+    current = live->current.load();
+}
+
+LiveEngine::Reader::~Reader(){
+    live->readers[slot].fetch_sub(1);
+}
+
+const TerrainDistanceEngine& LiveEngine::Reader::engine() const{
+    return *current->engine;
+}
+
+uint64_t LiveEngine::Reader::version() const{
+    return current ? current->number : 0;
+}
+
+//Swap the new version in, then wait out every reader that might hold the old one before freeing it
+//A reader counted in a slot AFTER we saw that slot empty also loaded current after our exchange, so it has the new version.
+//A reader that read activeSlot just before a flip can still land in the slot we're not waiting on, which is why both
+//slots get flipped away from and drained
+void LiveEngine::publish(unique_ptr<TerrainDistanceEngine> engine){
+    lock_guard<mutex> lock(publishMutex);
+    Version* old = current.load();
+    Version* next = new Version();
+    next->engine = move(engine);
+    next->number = old ? old->number + 1 : 1;
+    current.exchange(next);
+
+    for(int round = 0; round < 2; round++){
+        int drain = activeSlot.load();
+        activeSlot.store(1 - drain);
+        while(readers[drain].load() != 0){
+            this_thread::yield();
+        }
+    }
+    delete old;
+}
+
+uint64_t LiveEngine::version() const{
+    Reader reader(*this); //the version could be freed under us otherwise
+    return reader.version();
+}
+
+DatasetRegistry::DatasetRegistry(const Loader& loader, size_t budget) : load(loader), budgetBytes(budget), totalBytes(0), nextGeneration(1), numHits(0), numMisses(0), numEvictions(0){
+}
+
+DatasetRegistry::Dataset DatasetRegistry::acquire(const string& id){
+    unique_lock<mutex> lock(entriesMutex);
+    auto found = entries.find(id);
+    if(found != entries.end()){
+        Entry& entry = found->second;
+        if(entry.ready){
+            numHits++;
+            lru.splice(lru.begin(), lru, entry.recent);
+            return entry.loaded.get();
+        }
+        numMisses++;
+        shared_future<Dataset> loading = entry.loaded; //someone else is loading it, wait for theirs
+        lock.unlock();
+        return loading.get();
+    }
+
+    //first one here loads it, outside the lock so other datasets aren't held up
+    numMisses++;
+    promise<Dataset> loaded;
+    Entry& entry = entries[id];
+    entry.loaded = loaded.get_future().share();
+    entry.ready = false;
+    entry.bytes = 0;
+    lock.unlock();
+
+    //a loader that throws (bad_alloc, a filesystem error) counts as a failed load, the entry must never be left without a value
+    shared_ptr<TerrainDistanceEngine> engine;
+    bool ok = false;
+    try{
+        engine.reset(new TerrainDistanceEngine());
+        ok = load(id, *engine);
+    }
+    catch(...){
+        ok = false;
+    }
+
+    lock.lock();
+    Dataset dataset;
+    dataset.engine = ok ? engine : nullptr;
+    dataset.generation = ok ? nextGeneration++ : 0;
+    found = entries.find(id);
+    if(!ok){
+        entries.erase(found); //failures aren't remembered, the next acquire tries again
+    }
+    else{
+        Entry& done = found->second;
+        done.ready = true;
+        done.bytes = engine->residentBytes();
+        lru.push_front(id);
+        done.recent = lru.begin();
+        totalBytes += done.bytes;
+        evictOver(id);
+    }
+    loaded.set_value(dataset);
+    return dataset;
+}
+
+//Hit path only, under the lock: hands out a dataset that's already loaded and ready, never starts or waits for a load
+bool DatasetRegistry::tryAcquire(const string& id, Dataset& dataset){
+    lock_guard<mutex> lock(entriesMutex);
+    auto found = entries.find(id);
+    if(found == entries.end() || !found->second.ready){
+        return false;
+    }
+    numHits++;
+    lru.splice(lru.begin(), lru, found->second.recent);
+    dataset = found->second.loaded.get();
+    return true;
+}
+
+//Drop least recently used datasets (never keep) until everything fits the budget
+void DatasetRegistry::evictOver(const string& keep){
+    auto victim = lru.end();
+    while(totalBytes > budgetBytes && victim != lru.begin()){
+        --victim;
+        if(*victim == keep){
+            continue;
+        }
+        auto found = entries.find(*victim);
+        totalBytes -= found->second.bytes;
+        entries.erase(found);
+        victim = lru.erase(victim);
+        numEvictions++;
+    }
+}
+
+void DatasetRegistry::invalidate(const string& id){
+    lock_guard<mutex> lock(entriesMutex);
+    auto found = entries.find(id);
+    if(found == entries.end() || !found->second.ready){
+        return; //a load in flight finishes and stays, it started after whatever changed
+    }
+    totalBytes -= found->second.bytes;
+    lru.erase(found->second.recent);
+    entries.erase(found);
+}
+
+void DatasetRegistry::clear(){
+    lock_guard<mutex> lock(entriesMutex);
+    for(auto entry = entries.begin(); entry != entries.end();){
+        if(entry->second.ready){
+            totalBytes -= entry->second.bytes;
+            lru.erase(entry->second.recent);
+            entry = entries.erase(entry);
+        }
+        else{
+            ++entry;
+        }
+    }
+}
+
+size_t DatasetRegistry::residentBytes() const{
+    lock_guard<mutex> lock(entriesMutex);
+    return totalBytes;
+}
+
+int DatasetRegistry::numResident() const{
+    lock_guard<mutex> lock(entriesMutex);
+    return (int)lru.size();
+}
+
+vector<pair<string, DatasetRegistry::Dataset>> DatasetRegistry::resident() const{
+    lock_guard<mutex> lock(entriesMutex);
+    vector<pair<string, Dataset>> datasets;
+    for(const string& id : lru){
+        datasets.push_back(make_pair(id, entries.at(id).loaded.get()));
+    }
+    return datasets;
+}
+
+uint64_t DatasetRegistry::hits() const{
+    lock_guard<mutex> lock(entriesMutex);
+    return numHits;
+}
+
+uint64_t DatasetRegistry::misses() const{
+    lock_guard<mutex> lock(entriesMutex);
+    return numMisses;
+}
+
+uint64_t DatasetRegistry::evictions() const{
+    lock_guard<mutex> lock(entriesMutex);
+    return numEvictions;
+}
+
+ResultCache::ResultCache(size_t budgetBytes, int numShards){
+    numShards = max(1, numShards);
+    setsPerShard = max((size_t)1, budgetBytes / (sizeof(Slot) * WAYS * numShards));
+    for(int k = 0; k < numShards; k++){
+        unique_ptr<Shard> shard(new Shard());
+        shard->slots.assign(setsPerShard * WAYS, Slot());
+        shard->clock = 0;
+        shard->numHits = 0;
+        shard->numMisses = 0;
+        shards.push_back(move(shard));
+    }
+}
+
+SurfaceQuery ResultCache::canonical(const SurfaceQuery& q){
+    if(q.y2 < q.y1 || (q.y2 == q.y1 && q.x2 < q.x1)){
+        return SurfaceQuery{q.x2, q.y2, q.x1, q.y1};
+    }
+    return q;
+}
+
+ResultCache::Key ResultCache::makeKey(uint64_t version, int epoch, double rp, const SurfaceQuery& q){
+    SurfaceQuery c = canonical(q);
+    Key key;
+    key.version = version;
+    memcpy(&key.radiusBits, &rp, sizeof(rp));
+    key.endpoints = (uint64_t)(uint16_t)c.x1 | ((uint64_t)(uint16_t)c.y1 << 16) | ((uint64_t)(uint16_t)c.x2 << 32) | ((uint64_t)(uint16_t)c.y2 << 48);
+    key.epoch = (uint32_t)epoch;
+    return key;
+}
+
+//splitmix64 finalizer over the key fields, dashboards tend to ask about neighbouring pixels so the low bits need mixing
+uint64_t ResultCache::hashKey(const Key& key){
+    uint64_t h = key.endpoints ^ (key.version * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)key.epoch << 56) ^ key.radiusBits;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+ResultCache::Slot* ResultCache::findSet(const Key& key, Shard*& shard){
+    uint64_t h = hashKey(key);
+    shard = shards[h % shards.size()].get();
+    return &shard->slots[((h / shards.size()) % setsPerShard) * WAYS];
+}
+
+//Never hands out 0, that marks an empty slot
+uint32_t ResultCache::touch(Shard& shard){
+    if(++shard.clock == 0){
+        //wrapped after 4 billion touches, restart the ages (order inside a set is lost once, that's fine)
+        for(Slot& slot : shard.slots){
+            slot.used = (slot.used != 0) ? 1 : 0;
+        }
+        shard.clock = 2;
+    }
+    return shard.clock;
+}
+
+bool ResultCache::lookup(uint64_t version, int epoch, double rp, const SurfaceQuery& q, double& distance){
+    Key key = makeKey(version, epoch, rp, q);
+    Shard* shard;
+    Slot* set = findSet(key, shard);
+    lock_guard<mutex> lock(shard->lock);
+    for(int w = 0; w < WAYS; w++){
+        if(set[w].used != 0 && set[w].key == key){
+            set[w].used = touch(*shard);
+            shard->numHits++;
+            distance = set[w].distance;
+            TERRAIN_STAT(countStat(STAT_CACHE_HITS, 1);)
+            return true;
+        }
+    }
+    shard->numMisses++;
+    TERRAIN_STAT(countStat(STAT_CACHE_MISSES, 1);)
+    return false;
+}
+
+void ResultCache::insert(uint64_t version, int epoch, double rp, const SurfaceQuery& q, double distance){
+    Key key = makeKey(version, epoch, rp, q);
+    Shard* shard;
+    Slot* set = findSet(key, shard);
+    lock_guard<mutex> lock(shard->lock);
+    int victim = 0;
+    for(int w = 0; w < WAYS; w++){
+        if(set[w].used != 0 && set[w].key == key){
+            victim = w; //someone else got here first, same answer
+            break;
+        }
+        if(set[w].used < set[victim].used){
+            victim = w; //empty slots have used 0 so they go first
+        }
+    }
+    set[victim].key = key;
+    set[victim].distance = distance;
+    set[victim].used = touch(*shard);
+}
+
+void ResultCache::invalidate(uint64_t version){
+    for(unique_ptr<Shard>& shard : shards){
+        lock_guard<mutex> lock(shard->lock);
+        for(Slot& slot : shard->slots){
+            if(slot.key.version == version){
+                slot.used = 0;
+            }
+        }
+    }
+}
+
+void ResultCache::clear(){
+    for(unique_ptr<Shard>& shard : shards){
+        lock_guard<mutex> lock(shard->lock);
+        for(Slot& slot : shard->slots){
+            slot.used = 0;
+        }
+    }
+}
+
+size_t ResultCache::capacity() const{
+    return shards.size() * setsPerShard * WAYS;
+}
+
+uint64_t ResultCache::hits() const{
+    uint64_t total = 0;
+    for(const unique_ptr<Shard>& shard : shards){
+        lock_guard<mutex> lock(shard->lock);
+        total += shard->numHits;
+    }
+    return total;
+}
+
+uint64_t ResultCache::misses() const{
+    uint64_t total = 0;
+    for(const unique_ptr<Shard>& shard : shards){
+        lock_guard<mutex> lock(shard->lock);
+        total += shard->numMisses;
+    }
+    return total;
+}
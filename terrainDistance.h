@@ -0,0 +1,809 @@
+#ifndef TERRAIN_DISTANCE_H
+#define TERRAIN_DISTANCE_H
+
+//Surface distance library: the kernel, every query type and the indexes behind them, plus TerrainDistanceEngine which owns
+//loaded maps. Link terrainDistance.cpp (or libterraindistance.a) and include this, computeSurfaceDistance.cpp is the command line front end
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <cstdint>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include "eigen/Eigen/Dense"
+
+
+//ASSUMPTIONS
+//1. we won't try to query two contiguous pixels since that calculation is done more easily by hand
+//2. this kernel method will work :)
+
+//Spread the low 16 bits of v out to the even bits
+constexpr unsigned int spreadBits(unsigned int v){
+    v &= 0x0000ffffu;
+    v = (v | (v << 8)) & 0x00ff00ffu;
+    v = (v | (v << 4)) & 0x0f0f0f0fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+}
+
+//Z-order (Morton) key, interleaves the bits of x and y so pixels that are close in 2D are mostly close in the key
+constexpr unsigned int mortonKey(int x, int y){
+    return spreadBits((unsigned int)x) | (spreadBits((unsigned int)y) << 1);
+}
+
+//Memory layouts for a power of two map, i.e. where pixel (x,y) sits in the raster
+//Row-major is the layout of the .data files. A 5x5 stencil touches 5 rows that are a whole row apart
+struct RowMajorLayout{
+    template<int LOG2_WIDTH, int LOG2_HEIGHT> static constexpr int index(int x, int y){
+        return x + (y << LOG2_WIDTH);
+    }
+};
+
+//Square blocks of 2^LOG2_BLOCK pixels stored one after the other (row-major inside a block and between blocks)
+//8x8 blocks of bytes are exactly one 64 byte cache line, so a stencil touches at most 4 lines whatever the path direction
+template<int LOG2_BLOCK> struct BlockTiledLayout{
+    template<int LOG2_WIDTH, int LOG2_HEIGHT> static constexpr int index(int x, int y){
+        return ((((x >> LOG2_BLOCK) + ((y >> LOG2_BLOCK) << (LOG2_WIDTH - LOG2_BLOCK))) << (2 * LOG2_BLOCK))
+               | ((x & ((1 << LOG2_BLOCK) - 1)) + ((y & ((1 << LOG2_BLOCK) - 1)) << LOG2_BLOCK)));
+    }
+};
+
+//Z-order curve over the whole (square) map, local at every scale
+struct MortonLayout{
+    template<int LOG2_WIDTH, int LOG2_HEIGHT> static constexpr int index(int x, int y){
+        static_assert(LOG2_WIDTH == LOG2_HEIGHT, "Morton layout needs a square map");
+        return (int)mortonKey(x, y);
+    }
+};
+
+//Grid descriptors: map size, cell size in meters (pixels are cell-centered), meters per pixel value and memory layout
+//Fixed size grid, everything is a compile time constant so getIndex turns into shifts and the scale factors fold into the kernel
+template<int LOG2_WIDTH, int LOG2_HEIGHT, int CELL_SIZE, int VERTICAL_SCALE, class Layout = RowMajorLayout>
+struct FixedGrid{
+    static constexpr int log2Width = LOG2_WIDTH;
+    static constexpr int width = 1 << LOG2_WIDTH;
+    static constexpr int height = 1 << LOG2_HEIGHT;
+    static constexpr int numPixels = width * height;
+    static constexpr double cellSize = (double)CELL_SIZE;
+    static constexpr double halfCell = 0.5 * (double)CELL_SIZE;
+    static constexpr double verticalScale = (double)VERTICAL_SCALE;
+
+    static constexpr int index(int x, int y){
+        return Layout::template index<LOG2_WIDTH, LOG2_HEIGHT>(x, y);
+    }
+    static constexpr double center(int c){
+        return (double)c * cellSize + halfCell;
+    }
+};
+
+//The Mount St Helens maps: 512x512 cells 30 m wide, 11 m per pixel value
+typedef FixedGrid<9, 9, 30, 11> DefaultGrid;
+//Same map stored in 8x8 blocks or along a Z-order curve, see toLayout
+typedef FixedGrid<9, 9, 30, 11, BlockTiledLayout<3>> TiledGrid;
+typedef FixedGrid<9, 9, 30, 11, MortonLayout> MortonGrid;
+
+//Same interface filled in at runtime for inputs whose size is only known once they're loaded
+//Everything that takes a Grid is a template, so this costs a multiply instead of a shift but no virtual calls
+struct RuntimeGrid{
+    int width;
+    int height;
+    int numPixels;
+    double cellSize;
+    double halfCell;
+    double verticalScale;
+
+    int index(int x, int y) const{
+        return x + y * width;
+    }
+    double center(int c) const{
+        return (double)c * cellSize + halfCell;
+    }
+};
+
+//Read-only pixels of one map, wherever they are kept (a vector, a shared memory segment). It converts from the vector,
+//so everything that takes a MapView takes a loaded map as is
+struct MapView{
+    const unsigned char* pixels;
+
+    MapView() : pixels(nullptr) {}
+    MapView(const std::vector<unsigned char>& data) : pixels(data.data()) {}
+    explicit MapView(const unsigned char* p) : pixels(p) {}
+
+    unsigned char operator[](int idx) const{
+        return pixels[idx];
+    }
+};
+
+//Cumulative surface length along every row, column and both diagonals of one map
+//The lines are sampled at every pixel center (30 m apart, 30 root 2 on the diagonals, never more than rp) using the kernel height there,
+//so the length between two pixels on the same line is a difference of two entries plus the two end segments to the real pixel heights
+struct LinePrefixIndex{
+    std::vector<double> kernelHeights; //kernel height at each pixel center
+    std::vector<double> rows;          //length from x = 0 to (x,y) along row y
+    std::vector<double> columns;       //length from y = 0 to (x,y) along column x
+    std::vector<double> diagonals;     //length along the (+1,+1) diagonal through (x,y), from where it enters the map
+    std::vector<double> antiDiagonals; //length along the (+1,-1) diagonal through (x,y), from where it enters the map
+};
+
+//What the lookups read, pointers to the same tables wherever they are kept
+struct LinePrefixView{
+    const double* kernelHeights;
+    const double* rows;
+    const double* columns;
+    const double* diagonals;
+    const double* antiDiagonals;
+
+    LinePrefixView() : kernelHeights(nullptr), rows(nullptr), columns(nullptr), diagonals(nullptr), antiDiagonals(nullptr) {}
+    LinePrefixView(const LinePrefixIndex& index) : kernelHeights(index.kernelHeights.data()), rows(index.rows.data()), columns(index.columns.data()),
+                                                   diagonals(index.diagonals.data()), antiDiagonals(index.antiDiagonals.data()) {}
+};
+
+//Lanes per packed batch kernel and the longest query (in pixels along its major axis) sent to it
+//Packing only pays off with 256 bit registers (~10% over computeSurfaceDistancePair with -march=native, ~10% slower
+//on plain SSE2), so batches only use it in AVX builds
+const int LANES = 8;
+const int PACKED_MAX_PIXELS = 16;
+#ifdef __AVX__
+const bool PACK_SHORT_QUERIES = true;
+#else
+const bool PACK_SHORT_QUERIES = false;
+#endif
+
+//One A -> B query in pixel coordinates, for the batch APIs
+struct SurfaceQuery{
+    int x1, y1;
+    int x2, y2;
+};
+
+//The samples along A -> B, made on demand instead of stored: numSegments equal segments no longer than rp, sample i is
+//A + step*i (height 0) and the last one is exactly B. Nothing is allocated, so every path costs the same memory however long it is
+struct PathSampler{
+    Eigen::Vector3d A, B;
+    Eigen::Vector3d step; //direction * segmentLength
+    int numSegments;
+    double segmentLength;
+
+    Eigen::Vector3d operator[](int i) const{
+        if(i == numSegments){
+            return B;
+        }
+        return A + step * (double)i;
+    }
+};
+
+//Per-tile min/max pixel value of one map, used for cheap height bounds over a region
+struct HeightRangeTiles{
+    int tileSize;
+    int tilesPerSide;
+    std::vector<unsigned char> minValue; //tilesPerSide x tilesPerSide, tile (tx,ty) at tx + ty*tilesPerSide
+    std::vector<unsigned char> maxValue;
+};
+
+//Read-only view of the same, see LinePrefixView
+struct HeightRangeView{
+    int tileSize;
+    int tilesPerSide;
+    const unsigned char* minValue;
+    const unsigned char* maxValue;
+
+    HeightRangeView() : tileSize(0), tilesPerSide(0), minValue(nullptr), maxValue(nullptr) {}
+    HeightRangeView(const HeightRangeTiles& tiles) : tileSize(tiles.tileSize), tilesPerSide(tiles.tilesPerSide), minValue(tiles.minValue.data()), maxValue(tiles.maxValue.data()) {}
+};
+
+//Which tiles differ between the pre and post maps, built once per pair of maps
+//A kernel sample whose stencil only covers unchanged tiles has the same height on both maps
+struct ChangedTileIndex{
+    int tileSize;
+    int tilesPerSide;
+    std::vector<unsigned char> changed; //1 if any pixel in tile (tx,ty) differs, at tx + ty*tilesPerSide
+    int numChanged;
+};
+
+//Lots of maps of the same area kept as one full base map plus, for each epoch, only the 16x16 tiles that differ from the base
+//An epoch's tile table points either at the base (-1) or at a slot in the shared tile pool; a tile that is the same as in the
+//previous epoch reuses that epoch's slot, so a change that sticks around across epochs is only stored once
+const int EPOCH_TILE_SHIFT = 4;
+const int EPOCH_TILE = 1 << EPOCH_TILE_SHIFT;
+const int EPOCH_TILES_PER_SIDE = DefaultGrid::width / EPOCH_TILE;
+struct EpochStore{
+    std::vector<unsigned char> base;
+    std::vector<std::vector<int>> tileSlots;   //per epoch, EPOCH_TILES_PER_SIDE^2 entries at tx + ty*EPOCH_TILES_PER_SIDE
+    std::vector<unsigned char> tilePool;  //EPOCH_TILE^2 bytes per slot, row-major inside the tile
+};
+
+//Read-only view of one epoch that looks like the raw map to computeHeight: data[getIndex(x,y)] goes through the overlay
+struct EpochView{
+    const EpochStore* store;
+    const int* slots;
+
+    unsigned char operator[](int idx) const{
+        int x = idx & (DefaultGrid::width - 1);
+        int y = idx >> DefaultGrid::log2Width;
+        int slot = slots[(x >> EPOCH_TILE_SHIFT) + (y >> EPOCH_TILE_SHIFT) * EPOCH_TILES_PER_SIDE];
+        if(slot < 0){
+            return store->base[idx];
+        }
+        return store->tilePool[(slot << (2 * EPOCH_TILE_SHIFT)) + (x & (EPOCH_TILE - 1)) + ((y & (EPOCH_TILE - 1)) << EPOCH_TILE_SHIFT)];
+    }
+};
+
+//What the ghost cells around a HaloRaster hold, i.e. what the kernel sees past the edge of the map
+enum HaloFill{
+    HALO_ZERO_WEIGHT, //ghost cells get no weight, same as skipping them (the behavior of computeHeight)
+    HALO_CLAMP,       //copy of the nearest edge pixel
+    HALO_MIRROR,      //reflected about the edge pixel, x = -1 reads x = 1
+    HALO_TOROIDAL     //wraps around to the other side of the map
+};
+
+//The map padded with `halo` ghost cells on every side so the kernel never has to bounds check
+//Pixel (x,y) lives at (x + halo) + (y + halo)*stride. The halo has to cover the stencil reach (2 cells for rp <= 45 m),
+//buildHaloRaster clamps it to [2, width - 1]
+struct HaloRaster{
+    int halo;
+    int stride;
+    HaloFill fill;
+    std::vector<float> values;  //pixel values (not yet scaled by 11), ghost cells filled per the policy
+    std::vector<float> weights; //1 for real pixels, 0 for ghost cells under HALO_ZERO_WEIGHT, 1 everywhere otherwise
+
+    //raw pixel value by getIndex index, so HaloRaster can stand in for the plain map
+    float operator[](int idx) const{
+        return values[((idx & (DefaultGrid::width - 1)) + halo) + ((idx >> DefaultGrid::log2Width) + halo) * stride];
+    }
+};
+
+//Layout of a shared memory dataset: this header, then numEpochs blocks of epochBytes each starting at
+//SHARED_DATASET_ALIGN. A block holds the line prefix tables if lineTables (5 doubles per pixel: kernel heights, rows, columns,
+//diagonals, anti diagonals), then the pixels, then the height range tile minima and maxima
+//version is bumped whenever anything about the layout changes, attach refuses any other version
+const uint32_t SHARED_DATASET_MAGIC = 0x4d534454; //"TDSM"
+const uint32_t SHARED_DATASET_VERSION = 2;
+const uint64_t SHARED_DATASET_ALIGN = 64;
+struct SharedDatasetHeader{
+    uint32_t magic;             //written last, so a segment that is still being filled in doesn't attach
+    uint32_t version;
+    uint32_t headerBytes;       //sizeof(SharedDatasetHeader)
+    uint32_t width;
+    uint32_t height;
+    uint32_t numEpochs;
+    uint32_t heightTileSize;
+    uint32_t heightTilesPerSide;
+    uint32_t lineTables;        //1 if the blocks hold line prefix tables
+    uint32_t reserved;
+    uint64_t epochBytes;
+    uint64_t totalBytes;
+};
+
+//Hot path counters, to see where query time goes. Compiled in with -DTERRAIN_STATS, otherwise every TERRAIN_STAT(...) is empty
+//and the kernels are exactly as without them. Each thread counts in its own block, so counting is a plain add with no lock
+//or shared cache line, and readers sum the blocks (threads that exited are folded into a total)
+enum QueryStat{
+    STAT_QUERIES,             //surface distances computed, one per map (a pair is two)
+    STAT_SAMPLES,             //kernel evaluations along paths, one per sample point per map
+    STAT_STENCIL_VISITED,     //stencil pixels those evaluations looked at
+    STAT_STENCIL_ZERO_WEIGHT, //of those, the ones out of the kernel radius or off the map
+    STAT_CACHE_HITS,          //ResultCache
+    STAT_CACHE_MISSES,
+    STAT_TILES_FAULTED,       //8x8 tiles a path's stencil moved into, i.e. new cache lines in the tiled layout
+    STAT_BYTES_READ,          //map bytes read by the kernels
+    NUM_QUERY_STATS
+};
+
+struct QueryStats{
+    uint64_t counts[NUM_QUERY_STATS];
+};
+
+#ifdef TERRAIN_STATS
+const bool QUERY_STATS_ENABLED = true;
+#define TERRAIN_STAT(...) __VA_ARGS__
+#else
+const bool QUERY_STATS_ENABLED = false;
+#define TERRAIN_STAT(...)
+#endif
+
+struct ThreadStatsBlock{
+    std::atomic<uint64_t> counts[NUM_QUERY_STATS];
+};
+extern thread_local ThreadStatsBlock* threadStatsBlock;
+ThreadStatsBlock* registerThreadStats();
+
+//Only the owning thread writes its block, so a relaxed load and store is enough (no locked add)
+inline void countStat(QueryStat stat, uint64_t n){
+    ThreadStatsBlock* block = threadStatsBlock ? threadStatsBlock : registerThreadStats();
+    block->counts[stat].store(block->counts[stat].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+QueryStats threadQueryStats();  //calling thread so far, the difference across one query is what it cost
+QueryStats processQueryStats(); //every thread, including ones that exited
+QueryStats takeThreadQueryStats(); //calling thread's counts, zeroing them, see addThreadQueryStats
+void addThreadQueryStats(const QueryStats& stats); //worker threads hand their counts to the thread that started them
+QueryStats subtractQueryStats(const QueryStats& after, const QueryStats& before);
+std::string queryStatsJson(const QueryStats& stats); //{"queries":n,"samples":n,...}
+const char* queryStatName(QueryStat stat);
+
+//Everything a long-running process needs to answer surface distance queries, loaded and precomputed once
+//Epochs (one full map each) are added up front and get their height range tiles built right away, and their line prefix
+//tables too if the engine was made with lineIndexes (5 doubles and a kernel evaluation per pixel, only surfaceDistanceIndexed reads them).
+//After that the engine is read-only: every const method only reads and can be called from any number of threads at once.
+//Adding epochs while queries are running is NOT safe. Epoch numbers have to be < numEpochs()
+//
+//Instead of loading, a process can attach to a dataset another process published to shared memory (publishShared).
+//The segment is mapped read-only and queried in place, so any number of worker processes share one copy of the maps and indexes
+class TerrainDistanceEngine{
+public:
+    explicit TerrainDistanceEngine(bool lineIndexes = false);
+    ~TerrainDistanceEngine();
+    TerrainDistanceEngine(const TerrainDistanceEngine&) = delete; //may own mappings
+    TerrainDistanceEngine& operator=(const TerrainDistanceEngine&) = delete;
+
+    int loadEpoch(const std::string& fileName); //returns the new epoch's number, -1 if the file can't be read or isn't a 512x512 map
+    int addEpoch(const std::vector<unsigned char>& data);
+    bool publishShared(const std::string& name) const; //copy every epoch and its indexes into shared memory segment name
+    bool attachShared(const std::string& name);        //add every epoch of a published segment, without copying
+    int numEpochs() const;
+    MapView epochData(int epoch) const;
+    size_t residentBytes() const; //maps, indexes and mapped segments this engine holds
+
+    double surfaceDistance(int epoch, const SurfaceQuery& q) const;
+    double surfaceDistanceIndexed(int epoch, const SurfaceQuery& q) const; //prefix tables for rows/columns/diagonals (see LinePrefixIndex), walks without them
+    void surfaceDistancePair(int epochA, int epochB, const SurfaceQuery& q, double& distanceA, double& distanceB) const;
+    std::vector<double> surfaceDistanceMultiRadius(int epoch, const SurfaceQuery& q, const std::vector<double>& radii) const;
+    bool surfaceDistanceBelow(int epoch, const SurfaceQuery& q, double limit) const;
+    void surfaceDistanceBatch(int epochA, int epochB, const std::vector<SurfaceQuery>& queries, std::vector<double>& distancesA, std::vector<double>& distancesB, int numThreads) const;
+    void surfaceDistanceMap(int epochA, int epochB, int x0, int y0, std::vector<float>& mapA, std::vector<float>& mapB, std::vector<float>& mapDiff, int numThreads) const;
+    QueryStats stats() const; //what the queries on this engine cost so far, all zero without TERRAIN_STATS
+
+    //Adds what the calling thread counts while it's alive to the engine's totals. Every query method opens one, callers can
+    //open their own around work done for the engine (e.g. cache lookups) and then only the outermost scope on a thread counts
+    class StatsScope{
+    public:
+        explicit StatsScope(const TerrainDistanceEngine& engine);
+        ~StatsScope();
+    private:
+        const TerrainDistanceEngine& engine;
+        bool outermost;
+        QueryStats before;
+    };
+
+private:
+
+    //Queries only go through the views. For epochs added to this engine they point at the vectors here,
+    //for attached epochs into the mapped segment (and the vectors stay empty)
+    struct Epoch{
+        std::vector<unsigned char> data;
+        HeightRangeTiles heightRanges;
+        LinePrefixIndex lineIndex; //empty (and lineView null) unless lineIndexes
+        MapView pixels;
+        HeightRangeView heightRangeView;
+        LinePrefixView lineView;
+    };
+    std::vector<std::unique_ptr<Epoch>> epochs; //pointers, so the views survive the vector growing
+    std::vector<std::pair<void*, size_t>> mappings;
+    bool lineIndexes;
+    mutable std::atomic<uint64_t> statTotals[NUM_QUERY_STATS]; //there with or without TERRAIN_STATS so the layout doesn't change
+};
+
+bool removeShared(const std::string& name); //unpublish, processes that are attached keep their mapping
+
+//Hot swappable engine for processes that outlive their data: publish() swaps in a new engine (say with a new survey epoch)
+//while queries keep running. RCU style, a query holds a Reader for its duration and sees one version start to finish;
+//entering and leaving a Reader is two atomic increments, no lock. publish() waits until every Reader that could still see
+//the old version is gone and then frees it. Readers are counted in two alternating slots so new readers can't keep the
+//wait going forever
+class LiveEngine{
+    struct Version;
+
+public:
+    LiveEngine();
+    ~LiveEngine(); //no Readers may be left
+    LiveEngine(const LiveEngine&) = delete;
+    LiveEngine& operator=(const LiveEngine&) = delete;
+
+    class Reader{
+    public:
+        explicit Reader(const LiveEngine& live);
+        ~Reader();
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        const TerrainDistanceEngine& engine() const; //only after the first publish
+        uint64_t version() const;                    //0 before the first publish, then 1, 2, ...
+    private:
+        const LiveEngine* live;
+        int slot;
+        const Version* current;
+    };
+
+    void publish(std::unique_ptr<TerrainDistanceEngine> engine); //blocks until the old version is freed, publishes are serialized
+    uint64_t version() const;
+
+private:
+    struct Version{
+        std::unique_ptr<TerrainDistanceEngine> engine;
+        uint64_t number;
+    };
+    std::atomic<Version*> current;
+    std::atomic<int> activeSlot;
+    mutable std::atomic<long> readers[2];
+    std::mutex publishMutex;
+};
+
+//Many separate datasets (one engine each, e.g. one per volcano) by ID, loaded on first use and kept under a memory budget
+//acquire() hands out the dataset's engine, loading it with load(id, engine) if it isn't resident. Concurrent acquires of a
+//dataset that is loading wait for that one load instead of starting their own (single flight), other datasets load in parallel.
+//After every load the least recently used datasets are dropped until the resident bytes fit the budget again (the one just
+//loaded is never dropped, so a dataset bigger than the budget still works). A dropped engine lives on until the last
+//shared_ptr to it is released, so queries running on it are never cut off
+//Every load gets a new generation number, so anything cached about a dataset can tell a reload from the old data
+class DatasetRegistry{
+public:
+    typedef std::function<bool(const std::string& id, TerrainDistanceEngine& engine)> Loader;
+
+    struct Dataset{
+        std::shared_ptr<const TerrainDistanceEngine> engine; //null if it couldn't be loaded
+        uint64_t generation;
+    };
+
+    DatasetRegistry(const Loader& load, size_t budgetBytes);
+
+    Dataset acquire(const std::string& id); //engine is null if load failed or threw, the next acquire tries again
+    bool tryAcquire(const std::string& id, Dataset& dataset); //like acquire but only if it's resident, false instead of loading
+    void invalidate(const std::string& id); //drop it now, the next acquire loads it again
+    void clear();
+
+    size_t residentBytes() const;
+    int numResident() const;
+    std::vector<std::pair<std::string, Dataset>> resident() const; //loaded datasets, most recently used first
+    uint64_t hits() const;
+    uint64_t misses() const;      //acquires that had to load (or wait for a load)
+    uint64_t evictions() const;
+
+private:
+    struct Entry{
+        std::shared_future<Dataset> loaded;
+        bool ready;
+        size_t bytes;
+        std::list<std::string>::iterator recent; //position in lru, only once ready
+    };
+    void evictOver(const std::string& keep); //with entriesMutex held
+
+    Loader load;
+    size_t budgetBytes;
+    mutable std::mutex entriesMutex;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru; //most recent first, ready entries only
+    size_t totalBytes;
+    uint64_t nextGeneration;
+    uint64_t numHits, numMisses, numEvictions;
+};
+
+//Memo of recent query results, for clients that ask the same queries over and over
+//Keyed by the data version (LiveEngine version or DatasetRegistry generation), epoch, kernel radius and the endpoints put in a
+//canonical order, so A -> B and B -> A share one entry. Callers should always compute the canonical query (canonical(q)),
+//the walk isn't exactly symmetric in floating point, and that way the answer doesn't depend on whether it was cached
+//(up to the ~1e-12 m the packed batch kernel differs from the scalar walk by, for values computed in a packed batch).
+//Entries are spread over shards by hash, each with its own lock; a shard is a fixed table of 4 way sets that replaces the
+//least recently used entry of a set, so memory is fixed at construction and nothing is allocated afterwards.
+//A new version never sees old entries, invalidate(version) just frees their slots early
+class ResultCache{
+public:
+    ResultCache(size_t budgetBytes, int numShards = 64);
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+
+    static SurfaceQuery canonical(const SurfaceQuery& q); //lower (y,x) endpoint first
+
+    bool lookup(uint64_t version, int epoch, double rp, const SurfaceQuery& q, double& distance);
+    void insert(uint64_t version, int epoch, double rp, const SurfaceQuery& q, double distance);
+    void invalidate(uint64_t version); //drop every entry of that version
+    void clear();
+
+    size_t capacity() const; //entries
+    uint64_t hits() const;
+    uint64_t misses() const;
+
+private:
+    static const int WAYS = 4;
+    struct Key{
+        uint64_t version;
+        uint64_t radiusBits;
+        uint64_t endpoints; //canonical x1,y1,x2,y2, 16 bits each
+        uint32_t epoch;
+        bool operator==(const Key& other) const{
+            return version == other.version && radiusBits == other.radiusBits && endpoints == other.endpoints && epoch == other.epoch;
+        }
+    };
+    struct Slot{
+        Key key;
+        double distance;
+        uint32_t used;  //shard clock at the last hit, 0 while empty
+    };
+    struct Shard{
+        std::mutex lock;
+        std::vector<Slot> slots; //numSets sets of WAYS slots
+        uint32_t clock;
+        uint64_t numHits, numMisses;
+    };
+    static Key makeKey(uint64_t version, int epoch, double rp, const SurfaceQuery& q);
+    static uint64_t hashKey(const Key& key);
+    Slot* findSet(const Key& key, Shard*& shard);
+    static uint32_t touch(Shard& shard); //next clock value for a slot that was just used, with the shard's lock held
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    size_t setsPerShard;
+};
+
+std::vector<int> PointToGridIndeces(Eigen::Vector3d p);
+std::vector<double> computeSurfaceDistanceMultiRadius(int x1, int y1, int x2, int y2, const std::vector<double>& radii, MapView data);
+double computeSurfaceDistanceSampled(int x1, int y1, int x2, int y2, double rp, double maxStep, MapView data);
+PathSampler makePathSampler(const Eigen::Vector3d& A, const Eigen::Vector3d& B, double rp);
+void computeSurfaceDistanceMap(int x0, int y0, MapView dataPre, MapView dataPost, std::vector<float>& mapPre, std::vector<float>& mapPost, std::vector<float>& mapDiff, int numThreads);
+bool writeFloatRaster(const std::string& fileName, const std::vector<float>& raster);
+void computeSurfaceDistancePair(int x1, int y1, int x2, int y2, double rp, MapView dataPre, MapView dataPost, double& distancePre, double& distancePost);
+void computeSurfaceDistanceMatrix(const std::vector<Eigen::Vector2i>& points, MapView dataPre, MapView dataPost, std::vector<float>& matrixPre, std::vector<float>& matrixPost, int numThreads);
+bool writeDistanceMatrix(const std::string& fileName, const std::vector<float>& matrix, int n, bool upperTriangular);
+unsigned int hilbertKey(int x, int y, int log2Size);
+void computeSurfaceDistanceBatch(const std::vector<SurfaceQuery>& queries, MapView dataPre, MapView dataPost, std::vector<double>& distancesPre, std::vector<double>& distancesPost, int numThreads);
+int countSegments(double length, double rp);
+void computeSurfaceDistancePacked(const std::vector<SurfaceQuery>& queries, const std::vector<int>& which, MapView dataPre, MapView dataPost, std::vector<double>& distancesPre, std::vector<double>& distancesPost);
+HeightRangeTiles buildHeightRangeTiles(MapView data, int tileSize);
+bool surfaceDistanceBelow(int x1, int y1, int x2, int y2, double limit, MapView data, const HeightRangeView& tiles);
+ChangedTileIndex buildChangedTileIndex(MapView dataPre, MapView dataPost, int tileSize);
+bool stencilTouchesChange(const Eigen::Vector3d& p, double rp, const ChangedTileIndex& changedTiles);
+int getIndex(int x, int y);
+template<class Raster, class Grid = DefaultGrid> void computeHeight(Eigen::Vector3d& p, double rp, const Raster& data, const Grid& grid = Grid());
+HaloRaster buildHaloRaster(MapView data, int halo, HaloFill fill);
+void computeHeight(Eigen::Vector3d& p, double rp, const HaloRaster& data, const DefaultGrid& grid = DefaultGrid());
+template<class Raster, class Grid = DefaultGrid> double computeSurfaceDistance(int x1, int y1, int x2, int y2, double rp, const Raster& data, const Grid& grid = Grid());
+bool makeRuntimeGrid(int64_t width, int64_t height, double cellSize, double verticalScale, RuntimeGrid& grid); //false if int indexing can't address it
+LinePrefixIndex buildLinePrefixIndex(MapView data);
+bool lookupLineDistance(int x1, int y1, int x2, int y2, const LinePrefixView& index, MapView data, double& distance);
+double computeSurfaceDistanceIndexed(int x1, int y1, int x2, int y2, const LinePrefixView& index, MapView data);
+template<class Raster, class Grid = DefaultGrid> double walkSurfaceDistance(int x1, int y1, int x2, int y2, double rp, const Raster& data, const Grid& grid = Grid());
+int addEpoch(EpochStore& store, const std::vector<unsigned char>& data);
+EpochView getEpoch(const EpochStore& store, int epoch);
+size_t epochStoreBytes(const EpochStore& store);
+bool readRaster(const std::string& fileName, std::vector<unsigned char>& data, int numPixels = DefaultGrid::numPixels); //false unless the file is exactly numPixels bytes
+void computeHeightAndGradient(Eigen::Vector3d& p, Eigen::Vector2d& grad, double rp, MapView data);
+void computeHeightMultiRadius(const Eigen::Vector3d& p, const Eigen::ArrayXd& invRadii, double rMax, MapView data, Eigen::ArrayXd& heights); //heights are left alone for radii with no pixel in range
+void computeHeightBothEpochs(const Eigen::Vector3d& p, double rp, MapView dataPre, MapView dataPost, double& heightPre, double& heightPost);
+
+// Inspired by the scalar field construction done by Homel and Herbold 2016 to compute damage gradients in MPM
+// Free PDF on ResearchGate: https://www.researchgate.net/publication/303917651_Field-Gradient_Partitioning_for_Fracture_and_Frictional_Contact_in_the_Material_Point_Method
+// Check Equations 17 to 19
+// Grid describes the map layout (DefaultGrid unless told otherwise), Raster is anything indexable by grid.index(x,y)
+template<class Raster, class Grid> void computeHeight(Eigen::Vector3d& p, double rp, const Raster& data, const Grid& grid){
+    int i = (int)std::floor(p[0]/grid.cellSize); //get 2-D grid index --> which pixel is our query point inside?
+    int j = (int)std::floor(p[1]/grid.cellSize);
+    double Hx = 0; //field num, H(x)
+    double Sx = 0; //field denom, S(x)
+    TERRAIN_STAT(uint64_t offMap = 0; uint64_t outOfRange = 0;)
+    for(int r = i-2; r < i+3; r++){ //iterate the 5x5 stencil of neighbor cells 
+        for(int s = j-2; s < j+2; s++){
+            
+            //index filtering --> NO TOROIDAL BEHAVIOR HERE
+            if(r >= grid.width || s >= grid.height || r < 0 || s < 0){
+                TERRAIN_STAT(offMap++;)
+                continue;
+            }
+
+            Eigen::Vector3d pixelPos(grid.center(r), grid.center(s), 0.0);
+            int pixelIdx = grid.index(r, s);
+            double rBar = (p.head<2>() - pixelPos.head<2>()).norm() / rp; //kernel distance is planar, p may already carry a height from another epoch
+            double omega = 1 - (3 * rBar * rBar) + (2 * rBar * rBar * rBar);
+            if(rBar > 1.0){
+                omega = 0.0; //distance check is baked into rBar
+                TERRAIN_STAT(outOfRange++;)
+            }
+            double pixelHeight = (double)data[pixelIdx] * grid.verticalScale;
+
+            Hx += pixelHeight * omega;
+            Sx += omega;
+        }
+    }
+    if(Sx > 0){
+        p[2] = Hx / Sx; //set height in the point
+    }
+    TERRAIN_STAT(
+        countStat(STAT_SAMPLES, 1);
+        countStat(STAT_STENCIL_VISITED, 20);
+        countStat(STAT_STENCIL_ZERO_WEIGHT, offMap + outOfRange);
+        countStat(STAT_BYTES_READ, 20 - offMap);
+    )
+    
+    return;
+}
+
+//Surface distance from A to B on a single map, works on anything computeHeight can read (raw map, EpochView, HaloRaster)
+//and on any grid, fixed or runtime
+template<class Raster, class Grid> double computeSurfaceDistance(int x1, int y1, int x2, int y2, double rp, const Raster& data, const Grid& grid){
+    Eigen::Vector3d A(grid.center(x1), grid.center(y1), 0.0);
+    Eigen::Vector3d B(grid.center(x2), grid.center(y2), 0.0);
+    PathSampler path = makePathSampler(A, B, rp);
+    Eigen::Vector3d prevPoint = A;
+    prevPoint[2] = (double)data[grid.index(x1, y1)] * grid.verticalScale;
+    TERRAIN_STAT(countStat(STAT_QUERIES, 1); long tile = -1;)
+
+    double distance = 0.0;
+    for(int i = 1; i <= path.numSegments; i++){
+        Eigen::Vector3d currPoint = path[i];
+        if(i < path.numSegments){
+            currPoint[2] = prevPoint[2];
+            computeHeight(currPoint, rp, data, grid);
+            TERRAIN_STAT(
+                long cellTile = ((long)std::floor(currPoint[1]/grid.cellSize) >> 3) * (1L << 32) + ((long)std::floor(currPoint[0]/grid.cellSize) >> 3);
+                if(cellTile != tile){
+                    countStat(STAT_TILES_FAULTED, 1);
+                    tile = cellTile;
+                }
+            )
+        }
+        else{
+            currPoint[2] = (double)data[grid.index(x2, y2)] * grid.verticalScale;
+        }
+        distance += (currPoint - prevPoint).norm();
+        prevPoint = currPoint;
+    }
+    return distance;
+}
+
+//Rolling window of stencil heights for walking along one path
+//Consecutive samples are less than rp apart, so their stencils mostly overlap. The window keeps the heights (already scaled)
+//in a small ring buffer indexed by pixel coordinate mod SIZE and only reads the pixels that weren't in the last stencil
+template<class Raster, class Grid> struct StencilWindow{
+    static const int SIZE = 8; //ring length per axis, has to be bigger than the 5x4 stencil
+    const Raster* data;
+    Grid grid;
+    double heights[SIZE][SIZE]; //[r mod SIZE][s mod SIZE]
+    double weights[SIZE][SIZE]; //0 for cells off the map, same as computeHeight skipping them
+    int r0, r1, s0, s1;         //resident rectangle (inclusive), empty while r0 > r1
+    long loads;                 //pixels read from the raster so far
+
+    StencilWindow(const Raster& raster, const Grid& g) : data(&raster), grid(g), r0(0), r1(-1), s0(0), s1(-1), loads(0) {}
+
+    //make the stencil of the sample in cell (i,j) resident: columns i-2..i+2, rows j-2..j+1
+    void moveTo(int i, int j){
+        int nr0 = i - 2, nr1 = i + 2;
+        int ns0 = j - 2, ns1 = j + 1;
+        if(nr0 == r0 && ns0 == s0){
+            return; //same cell as last sample
+        }
+        for(int r = nr0; r <= nr1; r++){
+            for(int s = ns0; s <= ns1; s++){
+                if(r >= r0 && r <= r1 && s >= s0 && s <= s1){
+                    continue; //still resident from the last stencil
+                }
+                int slotR = r & (SIZE - 1);
+                int slotS = s & (SIZE - 1);
+                if(r < 0 || s < 0 || r >= grid.width || s >= grid.height){
+                    heights[slotR][slotS] = 0.0;
+                    weights[slotR][slotS] = 0.0;
+                }
+                else{
+                    heights[slotR][slotS] = (double)(*data)[grid.index(r, s)] * grid.verticalScale;
+                    weights[slotR][slotS] = 1.0;
+                    loads++;
+                }
+            }
+        }
+        r0 = nr0; r1 = nr1;
+        s0 = ns0; s1 = ns1;
+    }
+};
+
+//Same distance as computeSurfaceDistance, but the kernel reads its stencil through a StencilWindow that slides along the path
+//The planar offsets to the stencil columns and rows are separable, and some paths let us skip recomputing them:
+// - horizontal paths never change y, so the row offsets are computed once for the whole path
+// - vertical paths likewise for the column offsets
+// - 45 degree diagonals from pixel centers sit at the same offset inside their cell on both axes, so one table serves both
+template<class Raster, class Grid> double walkSurfaceDistance(int x1, int y1, int x2, int y2, double rp, const Raster& data, const Grid& grid){
+    Eigen::Vector3d A(grid.center(x1), grid.center(y1), 0.0);
+    Eigen::Vector3d B(grid.center(x2), grid.center(y2), 0.0);
+    Eigen::Vector3d direction = (B-A).normalized();
+    double length = (B-A).norm();
+    int numSegments = countSegments(length, rp);
+    double segmentLength = length / (double)numSegments;
+
+    bool horizontal = (y1 == y2);
+    bool vertical = (x1 == x2);
+    bool diagonal = (std::abs(x2 - x1) == std::abs(y2 - y1));
+
+    StencilWindow<Raster, Grid> window(data, grid);
+    double rp2 = rp * rp;
+    double dx2[5];
+    double dy2[4];
+    bool rowsReady = false;
+    bool columnsReady = false;
+
+    Eigen::Vector3d prevPoint = A;
+    prevPoint[2] = (double)data[grid.index(x1, y1)] * grid.verticalScale;
+    TERRAIN_STAT(uint64_t used = 0; uint64_t tiles = 0; long tile = -1;) //counted locally, added once per query
+    double distance = 0.0;
+    for(int k = 1; k <= numSegments; k++){
+        Eigen::Vector3d currPoint = B;
+        currPoint[2] = (double)data[grid.index(x2, y2)] * grid.verticalScale;
+        if(k < numSegments){
+            currPoint = A + (direction * segmentLength * (double)k);
+            currPoint[2] = prevPoint[2];
+            int i = (int)std::floor(currPoint[0]/grid.cellSize);
+            int j = (int)std::floor(currPoint[1]/grid.cellSize);
+            window.moveTo(i, j);
+            TERRAIN_STAT(
+                long cellTile = (long)(j >> 3) * (1L << 32) + (i >> 3);
+                if(cellTile != tile){
+                    tiles++;
+                    tile = cellTile;
+                }
+            )
+
+            if(!columnsReady){
+                for(int a = 0; a < 5; a++){
+                    double dx = currPoint[0] - grid.center(i - 2 + a);
+                    dx2[a] = dx * dx;
+                }
+                columnsReady = vertical;
+            }
+            if(!rowsReady){
+                if(diagonal && currPoint[0] - grid.center(i) == currPoint[1] - grid.center(j)){
+                    for(int b = 0; b < 4; b++){
+                        dy2[b] = dx2[b];
+                    }
+                }
+                else{
+                    for(int b = 0; b < 4; b++){
+                        double dy = currPoint[1] - grid.center(j - 2 + b);
+                        dy2[b] = dy * dy;
+                    }
+                }
+                rowsReady = horizontal;
+            }
+
+            //only a 3x3 or so patch of the stencil is ever within rp, skip the rest before paying for the sqrt
+            double Hx = 0;
+            double Sx = 0;
+            for(int a = 0; a < 5; a++){
+                if(dx2[a] > rp2){
+                    continue;
+                }
+                int slotR = (i - 2 + a) & (window.SIZE - 1);
+                for(int b = 0; b < 4; b++){
+                    if(dx2[a] + dy2[b] > rp2){
+                        continue;
+                    }
+                    int slotS = (j - 2 + b) & (window.SIZE - 1);
+                    double rBar = std::sqrt(dx2[a] + dy2[b]) / rp;
+                    double omega = (rBar > 1.0) ? 0.0 : (1 - (3 * rBar * rBar) + (2 * rBar * rBar * rBar));
+                    omega *= window.weights[slotR][slotS];
+                    Hx += window.heights[slotR][slotS] * omega;
+                    Sx += omega;
+                    TERRAIN_STAT(used += (omega > 0.0);)
+                }
+            }
+            if(Sx > 0){
+                currPoint[2] = Hx / Sx;
+            }
+        }
+        distance += (currPoint - prevPoint).norm();
+        prevPoint = currPoint;
+    }
+    TERRAIN_STAT(
+        uint64_t samples = (uint64_t)(numSegments - 1);
+        countStat(STAT_QUERIES, 1);
+        countStat(STAT_SAMPLES, samples);
+        countStat(STAT_STENCIL_VISITED, 20 * samples);
+        countStat(STAT_STENCIL_ZERO_WEIGHT, 20 * samples - used);
+        countStat(STAT_TILES_FAULTED, tiles);
+        countStat(STAT_BYTES_READ, (uint64_t)window.loads);
+    )
+    return distance;
+}
+
+#endif
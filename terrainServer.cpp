@@ -0,0 +1,467 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cmath>
+#include <csignal>
+#include <cerrno>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "terrainServer.h"
+
+using namespace std;
+
+//PAIR requests with at least this many queries go through the threaded, Hilbert sorted batch path
+//Smaller ones are answered inline, spinning up threads would cost more than the queries
+const uint32_t SERVER_BATCH_THRESHOLD = 256;
+//Stop reading from a client that has this many bytes of responses it hasn't picked up yet
+const size_t SERVER_MAX_PENDING_OUTPUT = 16 << 20;
+//Result cache size, about 1.3M queries
+const size_t SERVER_CACHE_BYTES = 64 << 20;
+
+static volatile sig_atomic_t serverStopping = 0;
+static volatile sig_atomic_t serverReloadRequested = 0;
+static volatile sig_atomic_t serverStatsRequested = 0;
+
+static void stopServer(int){
+    serverStopping = 1;
+}
+
+static void requestReload(int){
+    serverReloadRequested = 1;
+}
+
+static void requestStats(int){
+    serverStatsRequested = 1;
+}
+
+//Runs on its own thread so the event loop keeps answering while the new data loads and the old version drains
+static void reloadEngine(LiveEngine& live, const function<bool(TerrainDistanceEngine&)>& load, ResultCache& cache, atomic<bool>& reloading){
+    unique_ptr<TerrainDistanceEngine> engine(new TerrainDistanceEngine());
+    if(load(*engine)){
+        uint64_t oldVersion = live.version(); //this thread is the only one publishing
+        live.publish(move(engine));
+        cache.invalidate(oldVersion);
+        cout << "Reloaded, now serving version " << live.version() << endl;
+    }
+    else{
+        cerr << "Reload failed, still serving version " << live.version() << endl;
+    }
+    reloading = false;
+}
+
+//Not a wire status: the request's dataset is loading on another thread, the client's requests wait until it's done
+const uint8_t SERVER_LOADING = 255;
+
+//Dataset loads in registry mode, each on its own thread so the event loop keeps answering everyone else
+struct ServerLoads{
+    map<uint32_t, thread> running;
+    mutex finishedLock;
+    vector<pair<uint32_t, DatasetRegistry::Dataset>> finished; //filled by the load threads
+    map<uint32_t, DatasetRegistry::Dataset> justLoaded;        //what the waiting requests get, dropped once they have it
+    int wakeFds[2];                                            //pipe, a load thread writes a byte when it's done so poll wakes up
+};
+
+//Where requests get their data: one live set of epochs, or a registry of datasets by ID
+struct ServerData{
+    LiveEngine* live;
+    const function<bool(TerrainDistanceEngine&)>* load;
+    DatasetRegistry* registry;
+    ResultCache* cache;
+    ServerLoads* loads; //registry mode only
+};
+
+//One connected client, bytes in that don't make a whole request yet and bytes out that the socket hasn't taken yet
+struct ServerClient{
+    int fd;
+    vector<char> input;
+    vector<char> output;
+    size_t outputSent;
+    bool closing; //drop the connection once output is flushed
+    bool waiting; //the request at the front of input is waiting for its dataset to load
+};
+
+//acquire() on a thread of its own, the registry makes concurrent loads of one dataset share the work anyway
+static void startLoad(const ServerData& data, uint32_t dataset){
+    ServerLoads& loads = *data.loads;
+    if(loads.running.count(dataset)){
+        return;
+    }
+    loads.running[dataset] = thread([&loads, registry = data.registry, dataset](){
+        DatasetRegistry::Dataset loaded = registry->acquire(to_string(dataset));
+        {
+            lock_guard<mutex> lock(loads.finishedLock);
+            loads.finished.push_back(make_pair(dataset, loaded));
+        }
+        char byte = 0;
+        ssize_t written = write(loads.wakeFds[1], &byte, 1);
+        (void)written; //the pipe being full just means a wakeup is already pending
+    });
+}
+
+//One JSON line: the whole process, then what each engine's queries cost (the live version, or every resident dataset)
+static void printStats(const ServerData& data){
+    cout << "{\"process\":" << queryStatsJson(processQueryStats());
+    if(data.registry){
+        cout << ",\"datasets\":{";
+        bool first = true;
+        for(const pair<string, DatasetRegistry::Dataset>& dataset : data.registry->resident()){
+            if(dataset.second.engine){
+                cout << (first ? "" : ",") << "\"" << dataset.first << "\":" << queryStatsJson(dataset.second.engine->stats());
+                first = false;
+            }
+        }
+        cout << "}";
+    }
+    else{
+        LiveEngine::Reader reader(*data.live);
+        cout << ",\"version\":" << reader.version() << ",\"engine\":" << queryStatsJson(reader.engine().stats());
+    }
+    cout << "}" << endl;
+}
+
+static bool queryOnMap(const ServerQuery& q){
+    return q.x1 < DefaultGrid::width && q.x2 < DefaultGrid::width && q.y1 < DefaultGrid::height && q.y2 < DefaultGrid::height;
+}
+
+static void appendResponse(vector<char>& output, uint32_t id, uint8_t status, const vector<double>& values){
+    ServerResponseHeader header;
+    memset(&header, 0, sizeof(header));
+    header.id = id;
+    header.status = status;
+    header.numValues = (status == SERVER_OK) ? (uint32_t)values.size() : 0;
+    const char* headerBytes = reinterpret_cast<const char*>(&header);
+    output.insert(output.end(), headerBytes, headerBytes + sizeof(header));
+    if(status == SERVER_OK){
+        const char* valueBytes = reinterpret_cast<const char*>(values.data());
+        output.insert(output.end(), valueBytes, valueBytes + values.size() * sizeof(double));
+    }
+}
+
+//Answer one request on engine, queries points at its numQueries queries
+//Queries go through cache, keyed by version
+static uint8_t answerOnEngine(const TerrainDistanceEngine& engine, uint64_t version, ResultCache& cache, const ServerRequestHeader& header, const ServerQuery* queries, int numThreads, vector<double>& values){
+    TERRAIN_STAT(TerrainDistanceEngine::StatsScope scope(engine);) //so the engine's stats include its cache hits
+    if(header.op == SERVER_OP_INFO){
+        values.push_back((double)engine.numEpochs());
+        values.push_back((double)version);
+        values.push_back((double)cache.hits());
+        values.push_back((double)cache.misses());
+        return SERVER_OK;
+    }
+    if(header.op != SERVER_OP_DISTANCE && header.op != SERVER_OP_PAIR){
+        return SERVER_BAD_OP;
+    }
+    if(header.epochA >= engine.numEpochs() || (header.op == SERVER_OP_PAIR && header.epochB >= engine.numEpochs())){
+        return SERVER_BAD_EPOCH;
+    }
+
+    vector<SurfaceQuery> batch(header.numQueries);
+    for(uint32_t k = 0; k < header.numQueries; k++){
+        if(!queryOnMap(queries[k])){
+            return SERVER_BAD_QUERY;
+        }
+        //B -> A is answered as A -> B, cached or not, so a query and its reverse get the same answer (to about 1e-12 m, see
+        //terrainServer.h, since a big PAIR batch may use the packed kernel)
+        batch[k] = ResultCache::canonical(SurfaceQuery{queries[k].x1, queries[k].y1, queries[k].x2, queries[k].y2});
+    }
+    const double rp = DefaultGrid::cellSize * sqrt(2); //the engine's kernel radius
+
+    if(header.op == SERVER_OP_DISTANCE){
+        values.resize(header.numQueries);
+        for(uint32_t k = 0; k < header.numQueries; k++){
+            if(!cache.lookup(version, header.epochA, rp, batch[k], values[k])){
+                values[k] = engine.surfaceDistance(header.epochA, batch[k]);
+                cache.insert(version, header.epochA, rp, batch[k], values[k]);
+            }
+        }
+        return SERVER_OK;
+    }
+
+    values.resize(2 * (size_t)header.numQueries);
+    vector<SurfaceQuery> misses;
+    vector<uint32_t> missIndex;
+    for(uint32_t k = 0; k < header.numQueries; k++){
+        bool hitA = cache.lookup(version, header.epochA, rp, batch[k], values[2 * k]);
+        bool hitB = cache.lookup(version, header.epochB, rp, batch[k], values[2 * k + 1]);
+        if(!hitA || !hitB){
+            misses.push_back(batch[k]);
+            missIndex.push_back(k);
+        }
+    }
+    if(misses.size() >= SERVER_BATCH_THRESHOLD && numThreads > 1){
+        vector<double> distancesA, distancesB;
+        engine.surfaceDistanceBatch(header.epochA, header.epochB, misses, distancesA, distancesB, numThreads);
+        for(size_t m = 0; m < misses.size(); m++){
+            values[2 * missIndex[m]] = distancesA[m];
+            values[2 * missIndex[m] + 1] = distancesB[m];
+        }
+    }
+    else{
+        for(size_t m = 0; m < misses.size(); m++){
+            engine.surfaceDistancePair(header.epochA, header.epochB, misses[m], values[2 * missIndex[m]], values[2 * missIndex[m] + 1]);
+        }
+    }
+    for(size_t m = 0; m < misses.size(); m++){
+        cache.insert(version, header.epochA, rp, misses[m], values[2 * missIndex[m]]);
+        cache.insert(version, header.epochB, rp, misses[m], values[2 * missIndex[m] + 1]);
+    }
+    return SERVER_OK;
+}
+
+//The whole request is answered on one version of the data, even if a reload lands halfway through
+static uint8_t answerRequest(const ServerData& data, const ServerRequestHeader& header, const ServerQuery* queries, int numThreads, vector<double>& values){
+    values.clear();
+    if(data.registry){
+        DatasetRegistry::Dataset dataset;
+        auto loaded = data.loads->justLoaded.find(header.dataset);
+        if(loaded != data.loads->justLoaded.end()){
+            dataset = loaded->second; //may be a failed load, that gets SERVER_BAD_DATASET below instead of another try
+        }
+        else if(!data.registry->tryAcquire(to_string(header.dataset), dataset)){
+            startLoad(data, header.dataset);
+            return SERVER_LOADING;
+        }
+        if(!dataset.engine){
+            return SERVER_BAD_DATASET;
+        }
+        return answerOnEngine(*dataset.engine, dataset.generation, *data.cache, header, queries, numThreads, values);
+    }
+    if(header.dataset != 0){
+        return SERVER_BAD_DATASET;
+    }
+    LiveEngine::Reader reader(*data.live);
+    return answerOnEngine(reader.engine(), reader.version(), *data.cache, header, queries, numThreads, values);
+}
+
+//Answer every whole request sitting in the client's input, responses go to its output in the same order
+static void answerRequests(const ServerData& data, ServerClient& client, int numThreads, vector<double>& values){
+    size_t offset = 0;
+    while(!client.closing && client.input.size() - offset >= sizeof(ServerRequestHeader)){
+        ServerRequestHeader header;
+        memcpy(&header, client.input.data() + offset, sizeof(header));
+        if(header.numQueries > SERVER_MAX_QUERIES){
+            appendResponse(client.output, header.id, SERVER_TOO_BIG, values);
+            client.closing = true; //can't trust anything after this in the stream
+            break;
+        }
+        size_t requestBytes = sizeof(header) + (size_t)header.numQueries * sizeof(ServerQuery);
+        if(client.input.size() - offset < requestBytes){
+            break; //rest of this request hasn't arrived yet
+        }
+        vector<ServerQuery> queries(header.numQueries);
+        if(header.numQueries > 0){
+            memcpy(queries.data(), client.input.data() + offset + sizeof(header), header.numQueries * sizeof(ServerQuery));
+        }
+        uint8_t status = answerRequest(data, header, queries.data(), numThreads, values);
+        if(status == SERVER_LOADING){
+            client.waiting = true; //picked up again from here once the load finishes
+            break;
+        }
+        appendResponse(client.output, header.id, status, values);
+        offset += requestBytes;
+    }
+    client.input.erase(client.input.begin(), client.input.begin() + offset);
+}
+
+//Push as much pending output as the socket takes without blocking, false if the client is gone
+static bool flushOutput(ServerClient& client){
+    while(client.outputSent < client.output.size()){
+        ssize_t sent = send(client.fd, client.output.data() + client.outputSent, client.output.size() - client.outputSent, MSG_NOSIGNAL);
+        if(sent < 0){
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        client.outputSent += sent;
+    }
+    client.output.clear();
+    client.outputSent = 0;
+    return true;
+}
+
+static bool serve(const ServerData& data, const string& socketPath, int numThreads){
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(socketPath.size() >= sizeof(address.sun_path)){
+        cerr << "Socket path " << socketPath << " is too long!" << endl;
+        return false;
+    }
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenFd < 0){
+        cerr << "Failed to create socket: " << strerror(errno) << endl;
+        return false;
+    }
+    unlink(socketPath.c_str()); //left over from a server that didn't shut down cleanly
+    if(bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(listenFd, 64) < 0){
+        cerr << "Failed to listen on " << socketPath << ": " << strerror(errno) << endl;
+        close(listenFd);
+        return false;
+    }
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+
+    serverStopping = 0;
+    serverReloadRequested = 0;
+    serverStatsRequested = 0;
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    signal(SIGHUP, requestReload);
+    signal(SIGUSR1, requestStats);
+    thread reloader;
+    atomic<bool> reloading(false);
+    if(data.loads){
+        if(pipe(data.loads->wakeFds) < 0){
+            cerr << "Failed to create pipe: " << strerror(errno) << endl;
+            close(listenFd);
+            return false;
+        }
+        fcntl(data.loads->wakeFds[0], F_SETFL, fcntl(data.loads->wakeFds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(data.loads->wakeFds[1], F_SETFL, fcntl(data.loads->wakeFds[1], F_GETFL) | O_NONBLOCK);
+    }
+
+    //One thread runs the whole event loop, queries are short enough that answering them inline beats handing them off
+    vector<ServerClient> clients;
+    vector<pollfd> pollFds;
+    vector<double> values;
+    vector<char> readBuffer(1 << 16);
+    while(!serverStopping){
+        if(serverStatsRequested){
+            serverStatsRequested = 0;
+            printStats(data);
+        }
+        if(serverReloadRequested && data.registry){
+            serverReloadRequested = 0;
+            data.registry->clear(); //cheap, the loading happens on the next request for each dataset
+            data.cache->clear();
+            cout << "Dropped all resident datasets" << endl;
+        }
+        if(serverReloadRequested && !reloading){
+            serverReloadRequested = 0;
+            if(reloader.joinable()){
+                reloader.join(); //last reload, already done
+            }
+            reloading = true;
+            reloader = thread(reloadEngine, ref(*data.live), cref(*data.load), ref(*data.cache), ref(reloading));
+        }
+
+        pollFds.clear();
+        pollFds.push_back(pollfd{listenFd, POLLIN, 0});
+        pollFds.push_back(pollfd{data.loads ? data.loads->wakeFds[0] : -1, POLLIN, 0}); //negative fds are ignored
+        for(const ServerClient& client : clients){
+            short events = 0;
+            if(!client.closing && !client.waiting && client.output.size() < SERVER_MAX_PENDING_OUTPUT){
+                events |= POLLIN;
+            }
+            if(client.outputSent < client.output.size()){
+                events |= POLLOUT;
+            }
+            pollFds.push_back(pollfd{client.fd, events, 0});
+        }
+        if(poll(pollFds.data(), pollFds.size(), 200) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            cerr << "poll failed: " << strerror(errno) << endl;
+            break;
+        }
+
+        //finished dataset loads: hand each to the clients waiting on it, their output goes out in the pass below
+        if(pollFds[1].revents & POLLIN){
+            char drain[64];
+            while(read(data.loads->wakeFds[0], drain, sizeof(drain)) > 0){
+            }
+            {
+                lock_guard<mutex> lock(data.loads->finishedLock);
+                for(const pair<uint32_t, DatasetRegistry::Dataset>& done : data.loads->finished){
+                    data.loads->justLoaded[done.first] = done.second;
+                    data.loads->running[done.first].join();
+                    data.loads->running.erase(done.first);
+                }
+                data.loads->finished.clear();
+            }
+            for(ServerClient& client : clients){
+                if(client.waiting){
+                    client.waiting = false;
+                    answerRequests(data, client, numThreads, values);
+                }
+            }
+            data.loads->justLoaded.clear();
+        }
+
+        //clients are only added after the pass below so pollFds[c + 2] stays lined up with clients[c]
+        vector<bool> drop(clients.size(), false);
+        for(size_t c = 0; c < clients.size(); c++){
+            ServerClient& client = clients[c];
+            short revents = pollFds[c + 2].revents;
+            if(revents & POLLIN){
+                ssize_t got = recv(client.fd, readBuffer.data(), readBuffer.size(), 0);
+                if(got > 0){
+                    client.input.insert(client.input.end(), readBuffer.data(), readBuffer.data() + got);
+                    answerRequests(data, client, numThreads, values);
+                }
+                else if(got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+                    drop[c] = true; //client hung up
+                    continue;
+                }
+            }
+            else if(revents & (POLLERR | POLLHUP | POLLNVAL)){
+                drop[c] = true;
+                continue;
+            }
+            if(!flushOutput(client) || (client.closing && client.output.empty())){
+                drop[c] = true;
+            }
+        }
+        for(size_t c = clients.size(); c-- > 0;){
+            if(drop[c]){
+                close(clients[c].fd);
+                clients.erase(clients.begin() + c);
+            }
+        }
+
+        if(pollFds[0].revents & POLLIN){
+            int fd;
+            while((fd = accept(listenFd, nullptr, nullptr)) >= 0){
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                clients.push_back(ServerClient{fd, vector<char>(), vector<char>(), 0, false, false});
+            }
+        }
+    }
+
+    if(reloader.joinable()){
+        reloader.join();
+    }
+    if(data.loads){
+        for(pair<const uint32_t, thread>& load : data.loads->running){
+            load.second.join();
+        }
+        close(data.loads->wakeFds[0]);
+        close(data.loads->wakeFds[1]);
+    }
+    for(const ServerClient& client : clients){
+        close(client.fd);
+    }
+    close(listenFd);
+    unlink(socketPath.c_str());
+    return true;
+}
+
+bool runQueryServer(LiveEngine& live, const string& socketPath, int numThreads, const function<bool(TerrainDistanceEngine&)>& load){
+    ResultCache cache(SERVER_CACHE_BYTES);
+    return serve(ServerData{&live, &load, nullptr, &cache, nullptr}, socketPath, numThreads);
+}
+
+bool runQueryServer(DatasetRegistry& registry, const string& socketPath, int numThreads){
+    ResultCache cache(SERVER_CACHE_BYTES);
+    ServerLoads loads;
+    return serve(ServerData{nullptr, nullptr, &registry, &cache, &loads}, socketPath, numThreads);
+}
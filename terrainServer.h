@@ -0,0 +1,74 @@
+#ifndef TERRAIN_SERVER_H
+#define TERRAIN_SERVER_H
+
+//Long-running query server: keeps a TerrainDistanceEngine resident and answers queries over a Unix domain socket,
+//so tools don't pay for starting a process and reading the maps on every query
+//
+//Wire format, native byte order (the socket is local so both ends are the same machine):
+//  request  = ServerRequestHeader then numQueries ServerQuery
+//  response = ServerResponseHeader then numValues doubles
+//Requests can be pipelined, i.e. a client may send any number of requests without waiting, and the responses come
+//back in the same order carrying the request's id. One request can hold a whole batch of queries
+//Every request names a dataset, a server started on a single set of epochs only has dataset 0
+//Answers are cached (see ResultCache), a query and its reverse share an entry and both get the A -> B answer with the lower
+//(y,x) endpoint as A. Repeating a query gives the same answer to about 1e-12 m, not bit for bit: in AVX builds big PAIR
+//batches send short queries to the packed kernel, which rounds a little differently from the one-at-a-time walk
+
+#include <cstdint>
+#include <string>
+#include <functional>
+#include "terrainDistance.h"
+
+const uint32_t SERVER_MAX_QUERIES = 1 << 20; //per request, bigger requests get SERVER_TOO_BIG and the connection is closed
+
+enum ServerOp{
+    SERVER_OP_INFO = 0,     //no queries, four values back: the number of epochs, the data version (goes up on every (re)load),
+                            //and the result cache's hits and misses
+    SERVER_OP_DISTANCE = 1, //surface distance on epochA, one value per query
+    SERVER_OP_PAIR = 2      //surface distance on epochA and epochB, two values per query (A then B)
+};
+
+enum ServerStatus{
+    SERVER_OK = 0,
+    SERVER_BAD_OP = 1,
+    SERVER_BAD_EPOCH = 2,
+    SERVER_BAD_QUERY = 3,   //a pixel is off the map
+    SERVER_TOO_BIG = 4,
+    SERVER_BAD_DATASET = 5  //no such dataset, or it failed to load
+};
+
+struct ServerRequestHeader{
+    uint32_t id;            //echoed back in the response
+    uint8_t op;             //ServerOp
+    uint8_t epochA;
+    uint8_t epochB;
+    uint8_t reserved;
+    uint32_t numQueries;
+    uint32_t dataset;
+};
+
+struct ServerQuery{
+    uint16_t x1, y1;
+    uint16_t x2, y2;
+};
+
+struct ServerResponseHeader{
+    uint32_t id;
+    uint8_t status;         //ServerStatus, no values follow unless SERVER_OK
+    uint8_t reserved[3];
+    uint32_t numValues;
+};
+
+//Serve live (already published once) on socketPath until SIGINT/SIGTERM. Big PAIR batches are split over numThreads
+//SIGHUP reloads: load fills a fresh engine in the background and it's published to live, requests already being answered
+//finish on the old data and later ones see the new. If load fails the old data stays
+//SIGUSR1 prints the hot path counters (see QueryStat) as one JSON line, all zero unless built with TERRAIN_STATS
+//Returns false if the socket can't be set up
+bool runQueryServer(LiveEngine& live, const std::string& socketPath, int numThreads, const std::function<bool(TerrainDistanceEngine&)>& load);
+
+//Same, but serving every dataset in registry, request.dataset is looked up as its decimal string. A dataset that isn't
+//resident is loaded on a thread of its own: that client's requests wait for it (in order), everyone else keeps being
+//answered. SIGHUP drops all resident datasets and each one is loaded fresh on its next request
+bool runQueryServer(DatasetRegistry& registry, const std::string& socketPath, int numThreads);
+
+#endif